@@ -1,48 +1,212 @@
-#include "llvm/Pass.h"
+#include <string>
+#include <vector>
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Instrumentation/AddressSanitizer.h"
 #include "llvm/Transforms/Instrumentation/SanitizerCoverage.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace llvm;
 
+static cl::opt<bool> CountChecks(
+    "count-asan-checks", cl::init(false),
+    cl::desc("Count how many times each remaining ASan check runs and print the counts at exit"));
+
 namespace
 {
-    struct ASan : public ModulePass
+    struct ASan : public PassInfoMixin<ASan>
     {
-        static char ID;
-        ASan() : ModulePass(ID) {}
+        static bool isRequired() { return true; }
 
-        bool runOnModule(Module &M) override
+        PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM)
         {
             for (Function &F : M)
             {
                 F.addFnAttr(Attribute::SanitizeAddress);
             }
 
-            ModuleAnalysisManager MAM;
-            LoopAnalysisManager LAM;
-            FunctionAnalysisManager FAM;
-            CGSCCAnalysisManager CGAM;
-
-            PassBuilder PB;
-            PB.registerModuleAnalyses(MAM);
-            PB.registerCGSCCAnalyses(CGAM);
-            PB.registerFunctionAnalyses(FAM);
-            PB.registerLoopAnalyses(LAM);
-            PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+            // Counting needs every check to be a call, so have ASan call
+            // its __asan_load*/__asan_store* callbacks instead of checking
+            // shadow memory inline. The option is global, so it is put back
+            // once ASan has run.
+            cl::opt<int> *threshold = nullptr;
+            int oldThreshold = 0;
+            if (CountChecks)
+            {
+                auto &options = cl::getRegisteredOptions();
+                auto option = options.find("asan-instrumentation-with-call-threshold");
+                if (option != options.end())
+                {
+                    threshold = static_cast<cl::opt<int> *>(option->second);
+                    oldThreshold = *threshold;
+                    threshold->setValue(0);
+                }
+            }
 
+            // Run on the caller's analysis managers, so anything the
+            // earlier passes computed is reused.
             ModulePassManager MPM;
             MPM.addPass(ModuleSanitizerCoveragePass());
             MPM.addPass(ModuleAddressSanitizerPass(AddressSanitizerOptions(), false));
             MPM.run(M, MAM);
 
-            return true;
+            if (threshold)
+            {
+                threshold->setValue(oldThreshold);
+            }
+
+            if (CountChecks)
+            {
+                countChecks(M);
+            }
+
+            return PreservedAnalyses::none();
+        }
+
+        // Runtime calls that check memory: ASan's callbacks, and the region
+        // checks OptimizeASan hoists out of loops.
+        static bool isCheck(const Function *callee)
+        {
+            if (!callee)
+            {
+                return false;
+            }
+            StringRef name = callee->getName();
+            return name.startswith("__asan_load") || name.startswith("__asan_store") ||
+                   name.startswith("__asan_exp_") || name == "__asan_region_is_poisoned" ||
+                   name == "__asan_memcpy" || name == "__asan_memmove" || name == "__asan_memset";
+        }
+
+        // Gives every check its own counter, incremented right before it,
+        // and prints "asan-checks: <count> <function> <file:line:col>" for
+        // each check that ran when the program exits.
+        void countChecks(Module &M)
+        {
+            LLVMContext &context = M.getContext();
+            Type *i64 = Type::getInt64Ty(context);
+            Type *i8Ptr = Type::getInt8PtrTy(context);
+
+            std::vector<CallBase *> checks;
+            std::vector<std::string> sites;
+            for (Function &F : M)
+            {
+                unsigned index = 0;
+                for (Instruction &I : instructions(F))
+                {
+                    CallBase *call = dyn_cast<CallBase>(&I);
+                    if (!call || !isCheck(call->getCalledFunction()))
+                    {
+                        continue;
+                    }
+                    std::string site;
+                    raw_string_ostream os(site);
+                    os << F.getName();
+                    if (const DILocation *loc = call->getDebugLoc())
+                    {
+                        os << " " << loc->getFilename() << ":" << loc->getLine() << ":" << loc->getColumn();
+                    }
+                    else
+                    {
+                        os << " #" << index;
+                    }
+                    ++index;
+                    checks.push_back(call);
+                    sites.push_back(os.str());
+                }
+            }
+            if (checks.empty())
+            {
+                return;
+            }
+
+            ArrayType *countsTy = ArrayType::get(i64, checks.size());
+            GlobalVariable *counts = new GlobalVariable(M, countsTy, false, GlobalValue::InternalLinkage,
+                                                        ConstantAggregateZero::get(countsTy), "asan.check.counts");
+            for (unsigned i = 0; i < checks.size(); ++i)
+            {
+                IRBuilder<> builder(checks[i]);
+                Value *counter = builder.CreateConstInBoundsGEP2_64(countsTy, counts, 0, i);
+                builder.CreateAtomicRMW(AtomicRMWInst::Add, counter, ConstantInt::get(i64, 1), MaybeAlign(8), AtomicOrdering::Monotonic);
+            }
+
+            // void asan.check.dump(): prints every non-zero counter
+            Function *dump = Function::Create(FunctionType::get(Type::getVoidTy(context), false),
+                                              GlobalValue::InternalLinkage, "asan.check.dump", M);
+            BasicBlock *entry = BasicBlock::Create(context, "entry", dump);
+            BasicBlock *loop = BasicBlock::Create(context, "loop", dump);
+            BasicBlock *print = BasicBlock::Create(context, "print", dump);
+            BasicBlock *next = BasicBlock::Create(context, "next", dump);
+            BasicBlock *exit = BasicBlock::Create(context, "exit", dump);
+
+            IRBuilder<> builder(entry);
+            std::vector<Constant *> siteNames;
+            for (const std::string &site : sites)
+            {
+                siteNames.push_back(builder.CreateGlobalStringPtr(site, "asan.check.site"));
+            }
+            ArrayType *sitesTy = ArrayType::get(i8Ptr, sites.size());
+            GlobalVariable *siteTable = new GlobalVariable(M, sitesTy, true, GlobalValue::InternalLinkage,
+                                                           ConstantArray::get(sitesTy, siteNames), "asan.check.sites");
+            Value *format = builder.CreateGlobalStringPtr("asan-checks: %llu %s\n", "asan.check.format");
+            FunctionCallee dprintf = M.getOrInsertFunction("dprintf", FunctionType::get(Type::getInt32Ty(context), {Type::getInt32Ty(context), i8Ptr}, true));
+            builder.CreateBr(loop);
+
+            builder.SetInsertPoint(loop);
+            PHINode *i = builder.CreatePHI(i64, 2, "i");
+            i->addIncoming(ConstantInt::get(i64, 0), entry);
+            Value *count = builder.CreateLoad(i64, builder.CreateInBoundsGEP(countsTy, counts, {ConstantInt::get(i64, 0), i}));
+            builder.CreateCondBr(builder.CreateICmpNE(count, ConstantInt::get(i64, 0)), print, next);
+
+            builder.SetInsertPoint(print);
+            Value *site = builder.CreateLoad(i8Ptr, builder.CreateInBoundsGEP(sitesTy, siteTable, {ConstantInt::get(i64, 0), i}));
+            builder.CreateCall(dprintf, {ConstantInt::get(Type::getInt32Ty(context), 2), format, count, site});
+            builder.CreateBr(next);
+
+            builder.SetInsertPoint(next);
+            Value *iNext = builder.CreateAdd(i, ConstantInt::get(i64, 1));
+            i->addIncoming(iNext, next);
+            builder.CreateCondBr(builder.CreateICmpEQ(iNext, ConstantInt::get(i64, checks.size())), exit, loop);
+
+            builder.SetInsertPoint(exit);
+            builder.CreateRetVoid();
+
+            // register the dump with atexit from a constructor
+            Function *init = Function::Create(FunctionType::get(Type::getVoidTy(context), false),
+                                              GlobalValue::InternalLinkage, "asan.check.init", M);
+            builder.SetInsertPoint(BasicBlock::Create(context, "entry", init));
+            FunctionCallee atexit = M.getOrInsertFunction("atexit", FunctionType::get(Type::getInt32Ty(context), {dump->getType()}, false));
+            builder.CreateCall(atexit, {dump});
+            builder.CreateRetVoid();
+            appendToGlobalCtors(M, init, 0);
         }
     };
 }
 
-char ASan::ID = 0;
-static RegisterPass<ASan> X("asan", "Address Sanitizer module pass", false, false);
+// Registers "asan" for -passes pipelines, e.g.
+// opt -load-pass-plugin=... -passes='function(optimize-asan),asan'
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo()
+{
+    return {LLVM_PLUGIN_API_VERSION, "ASan", LLVM_VERSION_STRING,
+            [](PassBuilder &PB)
+            {
+                PB.registerPipelineParsingCallback(
+                    [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>)
+                    {
+                        if (Name == "asan")
+                        {
+                            MPM.addPass(ASan());
+                            return true;
+                        }
+                        return false;
+                    });
+            }};
+}
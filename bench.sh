@@ -0,0 +1,171 @@
+#!/bin/bash
+
+# Benchmarks each test program in three builds: uninstrumented, ASan, and
+# OptimizeASan + ASan. Prints one row per (test, build) with the median wall
+# time, overhead over the uninstrumented build, static instruction and check
+# counts, and how many checks ran (from a separate -count-asan-checks build).
+#
+# check.sh runs first, so a build that got faster by missing bugs shows up in
+# the same run. Its results go to stderr, and the script exits with an error
+# if any check failed.
+#
+# Example usage: ./bench.sh -q > bench.csv
+#                ./bench.sh -r 5 -j hw2perf1 loop1 > bench.json
+
+set -Eeuo pipefail
+
+# r = runs per build; the median is reported
+# q = quick run: shrink the 10^9-iteration main loops 100x
+# j = print JSON instead of CSV
+# s = skip check.sh
+RUNS=3
+QUICK=0
+JSON=0
+CHECK=1
+while getopts "r:qjs" opt; do
+    case $opt in
+        r)
+            RUNS=$OPTARG
+            ;;
+        q)
+            QUICK=1
+            ;;
+        j)
+            JSON=1
+            ;;
+        s)
+            CHECK=0
+            ;;
+    esac
+done
+
+shift $((OPTIND - 1))
+
+TESTCASES=("$@")
+if [ ${#TESTCASES[@]} -eq 0 ]; then
+    TESTCASES=(hw2perf1 hw2perf2 hw2perf3 hw2perf4 loop1 loop2 loop3 loop_invar test1)
+fi
+MODES=(plain asan optimize_asan)
+
+CHECK_FAILED=0
+if [ "$CHECK" -eq 1 ]; then
+    ./check.sh >&2 || CHECK_FAILED=1
+fi
+
+ROOT=$(pwd)
+OUT=$ROOT/bench_out
+mkdir -p $OUT
+cd $OUT
+
+PLUGINS="-load-pass-plugin $ROOT/build/optimize_asan/LLVMPJT_OPTIMIZE_ASAN.so -load-pass-plugin $ROOT/build/asan/LLVMPJT_ASAN.so"
+
+# Every program gets an argument, which keeps loop2 in bounds so that all
+# three builds run to completion.
+ARGS="~"
+
+# Builds $TESTCASE.bc with profile data attached, as in run.sh.
+profile() {
+    local TESTCASE=$1
+    if [ "$QUICK" -eq 1 ]; then
+        sed -e 's/\b1000000000\b/10000000/g' -e 's/\b2000000000\b/20000000/g' $ROOT/$TESTCASE.cpp > $TESTCASE.cpp
+    else
+        cp $ROOT/$TESTCASE.cpp $TESTCASE.cpp
+    fi
+
+    clang -Xclang -disable-O0-optnone -emit-llvm $TESTCASE.cpp -c -o $TESTCASE.bc
+    opt -passes='loop-simplify' $TESTCASE.bc -o $TESTCASE.out.bc
+    mv $TESTCASE.out.bc $TESTCASE.bc
+    opt -passes='pgo-instr-gen,instrprof' $TESTCASE.bc -o $TESTCASE.prof.bc
+    clang -fprofile-instr-generate -x ir $TESTCASE.prof.bc -o $TESTCASE.prof.exe
+    LLVM_PROFILE_FILE=$TESTCASE.profraw ./$TESTCASE.prof.exe $ARGS > /dev/null
+    llvm-profdata merge -o $TESTCASE.profdata $TESTCASE.profraw
+    opt -passes='pgo-instr-use' -pgo-test-profile-file=$TESTCASE.profdata $TESTCASE.bc -o $TESTCASE.out.bc
+    mv $TESTCASE.out.bc $TESTCASE.bc
+}
+
+# Builds $TESTCASE.$MODE$SUFFIX.bc and $TESTCASE.$MODE$SUFFIX.exe from
+# $TESTCASE.bc; any further arguments are passed to opt.
+build() {
+    local TESTCASE=$1 MODE=$2 SUFFIX=$3
+    shift 3
+    local PASSES LIBS=""
+    case $MODE in
+        plain)
+            PASSES="function(mem2reg,loop-rotate)"
+            ;;
+        asan)
+            PASSES="function(mem2reg,loop-rotate),asan"
+            LIBS="-lasan"
+            ;;
+        optimize_asan)
+            PASSES="function(mem2reg,loop-rotate),optimize-asan-ipo,function(optimize-asan),asan"
+            LIBS="-lasan"
+            ;;
+    esac
+    opt "$@" $PLUGINS -passes="$PASSES" $TESTCASE.bc -o $TESTCASE.$MODE$SUFFIX.bc
+    clang $LIBS -x ir $TESTCASE.$MODE$SUFFIX.bc -o $TESTCASE.$MODE$SUFFIX.exe
+}
+
+# Median wall time of $RUNS runs of $1, in seconds.
+median_time() {
+    local EXE=$1
+    for ((run = 0; run < RUNS; ++run)); do
+        local START=$(date +%s.%N)
+        ./$EXE $ARGS > /dev/null
+        local END=$(date +%s.%N)
+        awk -v s=$START -v e=$END 'BEGIN { printf "%.3f\n", e - s }'
+    done | sort -g | awk '{ t[NR] = $1 } END { print (NR % 2) ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2 }'
+}
+
+# Static counts from the final bitcode: instructions, and instrumented
+# checks (each one ends in a call to an ASan report function).
+static_insts() {
+    llvm-dis $1 -o - | grep -cE '^  [^ ;]' || true
+}
+static_checks() {
+    llvm-dis $1 -o - | grep -cE 'call void @__asan_report_' || true
+}
+
+# Checks executed in one run, summed over the sites that the
+# -count-asan-checks build prints at exit. The option lives in the ASan
+# plugin, so it has to be loaded with -load before opt parses it.
+dynamic_checks() {
+    local TESTCASE=$1 MODE=$2
+    if [ "$MODE" = plain ]; then
+        echo 0
+        return
+    fi
+    build $TESTCASE $MODE .count -load $ROOT/build/asan/LLVMPJT_ASAN.so -count-asan-checks
+    ./$TESTCASE.$MODE.count.exe $ARGS 2>&1 > /dev/null | awk '/^asan-checks: / { n += $2 } END { printf "%.0f\n", n }'
+}
+
+ROWS=()
+for TESTCASE in "${TESTCASES[@]}"; do
+    profile $TESTCASE
+    BASE_TIME=""
+    for MODE in "${MODES[@]}"; do
+        build $TESTCASE $MODE ""
+        TIME=$(median_time $TESTCASE.$MODE.exe)
+        if [ -z "$BASE_TIME" ]; then
+            BASE_TIME=$TIME
+        fi
+        OVERHEAD=$(awk -v t=$TIME -v b=$BASE_TIME 'BEGIN { printf "%.3f\n", (b > 0) ? t / b : 0 }')
+        ROWS+=("$TESTCASE,$MODE,$TIME,$OVERHEAD,$(static_insts $TESTCASE.$MODE.bc),$(static_checks $TESTCASE.$MODE.bc),$(dynamic_checks $TESTCASE $MODE)")
+    done
+done
+
+COLUMNS="test,mode,median_seconds,overhead,static_instructions,static_checks,dynamic_checks"
+if [ "$JSON" -eq 1 ]; then
+    printf '%s\n' "${ROWS[@]}" | awk -F, -v runs=$RUNS -v quick=$QUICK '
+        BEGIN { printf "{\"runs\": %d, \"quick\": %s, \"results\": [", runs, quick ? "true" : "false" }
+        {
+            printf "%s\n  {\"test\": \"%s\", \"mode\": \"%s\", \"median_seconds\": %s, \"overhead\": %s, \"static_instructions\": %s, \"static_checks\": %s, \"dynamic_checks\": %s}", \
+                (NR > 1) ? "," : "", $1, $2, $3, $4, $5, $6, $7
+        }
+        END { print "\n]}" }'
+else
+    echo $COLUMNS
+    printf '%s\n' "${ROWS[@]}"
+fi
+
+exit $CHECK_FAILED
@@ -0,0 +1,19 @@
+#include <stdlib.h>
+
+/**
+ * A small accessor reads the element after the one its caller just wrote.
+ * The caller's check only covers p[0], so the accessor has to keep its own.
+ */
+static int next(int *p)
+{
+    return p[1];
+}
+
+int main()
+{
+    int *p = (int *)malloc(sizeof(int));
+    *p = 1;
+    int r = next(p);
+    free(p);
+    return r;
+}
@@ -0,0 +1,15 @@
+/**
+ * A loop summing a global array that reads one element past its end. The
+ * bound depends on argc so that it can't be checked at compile time.
+ */
+int G[100];
+
+int main(int argc, char *argv[])
+{
+    int sum = 0;
+    for (int i = 0; i < 100 + argc; ++i)
+    {
+        sum += G[i];
+    }
+    return sum;
+}
@@ -0,0 +1,21 @@
+#include <stdlib.h>
+
+/**
+ * A helper fills three neighbouring ints, last one first, through a pointer
+ * to room for only argc of them. Their checks are merged into one check of
+ * the group, which has to report a WRITE of one int, as the store's own
+ * check would, rather than a read of the whole group.
+ */
+static void fill(int *p)
+{
+    p[2] = 0;
+    p[1] = 0;
+    p[0] = 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int *p = (int *)malloc(argc * sizeof(int));
+    fill(p);
+    free(p);
+}
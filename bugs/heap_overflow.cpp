@@ -0,0 +1,16 @@
+#include <stdlib.h>
+
+/**
+ * A loop over a heap array with an off-by-one bound. The last iteration
+ * writes one element past the end of the allocation.
+ */
+int main()
+{
+    int n = 1000;
+    int *p = (int *)malloc(n * sizeof(int));
+    for (int i = 0; i <= n; ++i)
+    {
+        p[i] = i;
+    }
+    free(p);
+}
@@ -0,0 +1,16 @@
+#include <stdlib.h>
+
+/**
+ * A loop that stores to a loop-invariant address one element past the end
+ * of a heap array.
+ */
+int main(int argc, char *argv[])
+{
+    int *a = (int *)malloc(10 * sizeof(int));
+    int k = 9 + argc;
+    for (int i = 0; i < 1000; ++i)
+    {
+        a[k] = i;
+    }
+    free(a);
+}
@@ -0,0 +1,18 @@
+#include <stdlib.h>
+
+/**
+ * A loop that walks a heap array from the end down and reads one element
+ * before its start.
+ */
+int main()
+{
+    int n = 1000;
+    int *p = (int *)calloc(n, sizeof(int));
+    int sum = 0;
+    for (int i = n - 1; i >= -1; --i)
+    {
+        sum += p[i];
+    }
+    free(p);
+    return sum;
+}
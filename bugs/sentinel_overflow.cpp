@@ -0,0 +1,24 @@
+#include <stdlib.h>
+
+/**
+ * A loop that scans a heap array for a zero that was never stored, and
+ * reads one element past its end. Its trip count isn't known up front, so
+ * its check can't be hoisted as a range; with -optimize-asan-batch it is
+ * checked a batch of iterations at a time.
+ */
+int main()
+{
+    int n = 1000;
+    int *p = (int *)malloc(n * sizeof(int));
+    for (int i = 0; i < n; ++i)
+    {
+        p[i] = i + 1;
+    }
+    int i = 0;
+    while (p[i] != 0)
+    {
+        ++i;
+    }
+    free(p);
+    return i;
+}
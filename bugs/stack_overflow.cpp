@@ -0,0 +1,14 @@
+/**
+ * A loop over a stack array with an off-by-one bound. The last iteration
+ * writes one element past the end of the array.
+ */
+int main(int argc, char *argv[])
+{
+    int A[100];
+    int n = 100 + argc;
+    for (int i = 0; i < n; ++i)
+    {
+        A[i] = i;
+    }
+    return A[argc];
+}
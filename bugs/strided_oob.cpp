@@ -0,0 +1,18 @@
+#include <stdlib.h>
+
+/**
+ * A loop that reads every third element of a heap array and runs one stride
+ * past its end.
+ */
+int main()
+{
+    int n = 999;
+    int *p = (int *)calloc(n, sizeof(int));
+    int sum = 0;
+    for (int i = 0; i <= n; i += 3)
+    {
+        sum += p[i];
+    }
+    free(p);
+    return sum;
+}
@@ -0,0 +1,18 @@
+#include <stdlib.h>
+
+/**
+ * A loop over a heap array that has already been freed. The loop itself
+ * doesn't free anything, so its checks are candidates for hoisting.
+ */
+int main()
+{
+    int n = 1000;
+    int *p = (int *)malloc(n * sizeof(int));
+    free(p);
+    int sum = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        sum += p[i];
+    }
+    return sum;
+}
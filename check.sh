@@ -0,0 +1,105 @@
+#!/bin/bash
+
+# Builds each buggy program with ASan and with OptimizeASan + ASan, runs them,
+# and checks that the optimized builds report the same error as the baseline:
+# the same bug type, access kind and size, and source location. OptimizeASan
+# is built with its default options, with -optimize-asan-batch and with
+# -optimize-asan-vectorize.
+#
+# Programs under clean/ have no bug, and no build may report one.
+#
+# Example usage: ./check.sh
+#                ./check.sh bugs/heap_overflow loop2 clean/early_exit
+
+set -Euo pipefail
+
+TESTCASES=("$@")
+if [ ${#TESTCASES[@]} -eq 0 ]; then
+    TESTCASES=(bugs/*.cpp clean/*.cpp loop2)
+fi
+
+ROOT=$(pwd)
+OUT=$ROOT/check_out
+mkdir -p $OUT
+cd $OUT
+
+PLUGINS="-load-pass-plugin $ROOT/build/optimize_asan/LLVMPJT_OPTIMIZE_ASAN.so -load-pass-plugin $ROOT/build/asan/LLVMPJT_ASAN.so"
+
+# OptimizeASan builds to compare with the baseline: a name, then any further
+# arguments to opt. The pass's options are only known to opt once the plugin
+# is loaded with -load.
+LOAD="-load $ROOT/build/optimize_asan/LLVMPJT_OPTIMIZE_ASAN.so"
+VARIANTS=(
+    "optimize_asan"
+    "batch $LOAD -optimize-asan-batch=4"
+    "vectorize $LOAD -optimize-asan-vectorize"
+)
+
+# Builds $NAME.bc from $SRC, with debug info so that reports name the source
+# line.
+compile() {
+    local SRC=$1 NAME=$2
+    clang -g -Xclang -disable-O0-optnone -emit-llvm $SRC -c -o $NAME.bc
+    opt -passes='loop-simplify' $NAME.bc -o $NAME.out.bc
+    mv $NAME.out.bc $NAME.bc
+}
+
+# Builds $NAME.$MODE.exe from $NAME.bc, with OptimizeASan unless $MODE is
+# asan; any further arguments are passed to opt.
+build() {
+    local NAME=$1 MODE=$2
+    shift 2
+    local PASSES="function(mem2reg,loop-rotate)"
+    if [ "$MODE" != asan ]; then
+        PASSES="$PASSES,optimize-asan-ipo,function(optimize-asan)"
+    fi
+    opt "$@" $PLUGINS -passes="$PASSES,asan" $NAME.bc -o $NAME.$MODE.bc
+    clang -g -lasan -x ir $NAME.$MODE.bc -o $NAME.$MODE.exe
+}
+
+# Runs $1 and prints its ASan report as "<bug type> <access> <site>", e.g.
+# "heap-buffer-overflow WRITE of size 4 main heap_overflow.cpp:13", or
+# "no report".
+report() {
+    local LOG
+    LOG=$(ASAN_OPTIONS=symbolize=1 ./$1 2>&1 > /dev/null)
+    local TYPE=$(echo "$LOG" | sed -n 's/.*ERROR: AddressSanitizer: \([a-z-]*\).*/\1/p' | head -1)
+    local ACCESS=$(echo "$LOG" | grep -oE '(READ|WRITE) of size [0-9]+' | head -1)
+    local SITE=$(echo "$LOG" | sed -n 's/^ *#0 0x[0-9a-f]* in \([^ ]*\) .*\/\([^/:]*:[0-9]*\).*/\1 \2/p' | head -1)
+    if [ -z "$TYPE" ]; then
+        echo "no report"
+    else
+        echo "$TYPE $ACCESS $SITE"
+    fi
+}
+
+FAILED=0
+for TESTCASE in "${TESTCASES[@]}"; do
+    SRC=$ROOT/${TESTCASE%.cpp}.cpp
+    NAME=$(basename ${TESTCASE%.cpp})
+    compile $SRC $NAME
+    build $NAME asan
+    EXPECTED=$(report $NAME.asan.exe)
+    if [[ $TESTCASE == clean/* ]] && [ "$EXPECTED" != "no report" ]; then
+        echo "FAIL $NAME: the baseline reports '$EXPECTED'"
+        FAILED=1
+        continue
+    elif [[ $TESTCASE != clean/* ]] && [ "$EXPECTED" = "no report" ]; then
+        echo "FAIL $NAME: the baseline doesn't report an error"
+        FAILED=1
+        continue
+    fi
+    for VARIANT in "${VARIANTS[@]}"; do
+        read -r MODE FLAGS <<< "$VARIANT"
+        build $NAME $MODE $FLAGS
+        ACTUAL=$(report $NAME.$MODE.exe)
+        if [ "$EXPECTED" != "$ACTUAL" ]; then
+            echo "FAIL $NAME $MODE: expected '$EXPECTED', got '$ACTUAL'"
+            FAILED=1
+        else
+            echo "PASS $NAME $MODE: $EXPECTED"
+        fi
+    done
+done
+
+exit $FAILED
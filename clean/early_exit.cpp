@@ -0,0 +1,24 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * A loop whose bound runs one element past the end of its buffer, but
+ * which never gets there: the iteration that would overflow replaces the
+ * process first. execv doesn't free memory, so the loop's checks can still
+ * be hoisted, but a hoisted check must not report the last iteration.
+ */
+int main()
+{
+    int n = 10;
+    int *p = (int *)malloc((n - 1) * sizeof(int));
+    char *args[] = {(char *)"true", nullptr};
+    for (int i = 0; i < n; ++i)
+    {
+        if (i == n - 1)
+        {
+            execv("/bin/true", args);
+        }
+        p[i] = i;
+    }
+    free(p);
+}
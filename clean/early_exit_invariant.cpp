@@ -0,0 +1,25 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * A loop reads through a pointer to a buffer too small for an int, but
+ * replaces the process before the first read. The address doesn't change
+ * between iterations, so the read's check can be hoisted, but a hoisted
+ * check must not report a read that never happens.
+ */
+int main()
+{
+    int *p = (int *)malloc(2);
+    char *args[] = {(char *)"true", nullptr};
+    int sum = 0;
+    for (int i = 0; i < 10; ++i)
+    {
+        if (i == 0)
+        {
+            execv("/bin/true", args);
+        }
+        sum += *p;
+    }
+    free(p);
+    return sum;
+}
@@ -0,0 +1,25 @@
+#include <stdlib.h>
+
+/**
+ * A helper reads p[0], and p[1] only when it is told there is one. Its
+ * caller passes a buffer of one int, so the branch is never taken. The two
+ * reads are close enough to share a check, but one above the branch would
+ * check p[1] on a path that never reads it.
+ */
+static int sum(int *p, int n)
+{
+    int s = p[0];
+    if (n > 1)
+    {
+        s += p[1];
+    }
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    int *p = (int *)calloc(argc, sizeof(int));
+    int s = sum(p, argc);
+    free(p);
+    return s;
+}
@@ -1,15 +1,27 @@
 #include <vector>
 #include <list>
 #include <utility>
+#include <optional>
 #include <unordered_set>
 #include <unordered_map>
-#include "llvm/Pass.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
@@ -19,82 +31,168 @@
 #include "llvm/Analysis/MemoryLocation.h"
 #include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemoryBuiltins.h"
 #include "llvm/Analysis/IVDescriptors.h"
-#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/MustExecute.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Transforms/Instrumentation/AddressSanitizerCommon.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
 
 using namespace llvm;
 
+#define DEBUG_TYPE "optimize-asan"
+
+STATISTIC(NumInBounds, "Number of checks removed because the access is in bounds");
+STATISTIC(NumHeapInBounds, "Number of checks removed because the access is inside a live heap object");
+STATISTIC(NumRangeHoisted, "Number of checks replaced by a hoisted range check");
+STATISTIC(NumRangeVersioned, "Number of conditional checks versioned on a hoisted range query");
+STATISTIC(NumRedundant, "Number of checks removed because the address was already checked");
+STATISTIC(NumGrouped, "Number of checks merged into group checks");
+STATISTIC(NumGroupChecks, "Number of group checks inserted");
+STATISTIC(NumInvariantHoisted, "Number of checks of loop-invariant addresses hoisted");
+STATISTIC(NumInvariantVersioned, "Number of conditional checks of loop-invariant addresses versioned on a hoisted query");
+STATISTIC(NumFrequentPath, "Number of checks moved off the frequent path of a loop");
+STATISTIC(NumRejected, "Number of check placements rejected by the cost model");
+STATISTIC(NumIndexVersioned, "Number of checks versioned on a hoisted query of their bounded index range");
+STATISTIC(NumBatched, "Number of checks replaced by batched checks of upcoming iterations");
+STATISTIC(NumVectorized, "Number of loops vectorized after all their checks were hoisted");
+STATISTIC(NumEntryChecks, "Number of callee entry checks removed because every caller checked the argument");
+STATISTIC(NumUncheckedClones, "Number of functions cloned without their entry checks");
+STATISTIC(NumRedirectedCalls, "Number of calls redirected to an unchecked clone");
+
+static cl::opt<unsigned> GroupWindow(
+	"optimize-asan-group-window", cl::init(64),
+	cl::desc("Largest span in bytes that accesses off the same base can cover with one merged check"));
+
+static cl::opt<unsigned> IndexSpan(
+	"optimize-asan-index-span", cl::init(1 << 16),
+	cl::desc("Largest span in bytes that a bounded index (like h % 1000) may reach for its accesses to be versioned on one hoisted query"));
+
+static cl::opt<unsigned> BatchIterations(
+	"optimize-asan-batch", cl::init(0),
+	cl::desc("Check affine accesses that range hoisting can't handle once every this many iterations, for the iterations to come (0 = off)"));
+
+static cl::opt<bool> Vectorize(
+	"optimize-asan-vectorize", cl::init(false),
+	cl::desc("Run the loop vectorizer on innermost loops whose checks were all hoisted or removed (other loops are not touched)"));
+
+static cl::opt<unsigned> CloneLimit(
+	"optimize-asan-clone-limit", cl::init(64),
+	cl::desc("Largest function (in instructions) to clone without its entry checks for callers that already checked the arguments"));
+
 namespace
 {
-	struct OptimizeASan : public FunctionPass
+	struct OptimizeASan : public PassInfoMixin<OptimizeASan>
 	{
-		static char ID;
-		OptimizeASan() : FunctionPass(ID) {}
+		// When added to clang's pipeline, only touch functions that clang
+		// is going to instrument.
+		bool onlySanitized;
+		OptimizeASan(bool onlySanitized = false) : onlySanitized(onlySanitized) {}
+
+		// Run even on optnone functions, since ASan instruments those too.
+		static bool isRequired() { return true; }
 
-		void getAnalysisUsage(AnalysisUsage &AU) const override
+		Function *curF = nullptr;
+		FunctionAnalysisManager *FAM = nullptr;
+
+		// Analyses are shared with the rest of the pipeline through FAM. We
+		// keep DominatorTree and LoopInfo up to date as we split blocks.
+		template <typename AnalysisT>
+		typename AnalysisT::Result &getAnalysis()
 		{
-			// Add analysis passes
-			AU.addRequired<AAResultsWrapperPass>();
-			AU.addRequired<DominatorTreeWrapperPass>();
-			AU.addRequired<PostDominatorTreeWrapperPass>();
-			AU.addRequired<ScalarEvolutionWrapperPass>();
-			AU.addRequired<BranchProbabilityInfoWrapperPass>();
-			AU.addRequired<LoopInfoWrapperPass>();
-			AU.addRequired<DependenceAnalysisWrapperPass>();
+			return FAM->getResult<AnalysisT>(*curF);
 		}
 
-		void no_sanitize_gep(Value *gep, MDNode *nosanitize)
+		// Returns true if inst may free or re-poison memory that an earlier
+		// check already validated.
+		bool mayFreeMemory(Instruction *inst)
 		{
-			for (auto u : gep->users())
+			auto call = dyn_cast<CallBase>(inst);
+			if (!call)
 			{
-				if (auto inst = dyn_cast<Instruction>(u))
-				{
-					if (inst->getOpcode() == Instruction::Load || inst->getOpcode() == Instruction::Store)
-					{
-						inst->setMetadata(LLVMContext::MD_nosanitize, nosanitize);
-					}
-				}
+				return false;
 			}
-		}
-
-		void eliminate_mem(std::unordered_map<Value *, int> &ptr_group, int m)
-		{
-			for (auto &[v, x] : ptr_group)
+			if (auto intrinsic = dyn_cast<IntrinsicInst>(call))
 			{
-				if (x == m)
+				if (intrinsic->getIntrinsicID() == Intrinsic::lifetime_end)
 				{
-					x = -1;
+					return true;
 				}
 			}
-		}
-
-		unsigned get_width(Instruction *inst)
-		{
-			Type *t;
-			if (inst->getOpcode() == Instruction::Load)
+			if (call->onlyReadsMemory() || call->hasFnAttr(Attribute::NoFree))
 			{
-				t = inst->getType();
+				return false;
 			}
-			else
+
+			// Library calls usually lack nofree here, since nothing has
+			// inferred attributes for their declarations yet. Apart from
+			// the ones that deallocate or call back into the program,
+			// (printf, memcmp, sqrt, ...) they leave the program's memory
+			// allocated.
+			Function *callee = call->getCalledFunction();
+			TargetLibraryInfo &TLI = getAnalysis<TargetLibraryAnalysis>();
+			LibFunc func;
+			if (!callee || !TLI.getLibFunc(*callee, func) || isLibFreeFunction(callee, func) || isReallocLikeFn(callee, &TLI))
 			{
-				t = inst->getOperand(0)->getType();
+				return true;
 			}
-
-			if (t->isIntegerTy())
+			switch (func)
 			{
-				return t->getIntegerBitWidth();
+			case LibFunc_fclose:
+			case LibFunc_pclose:
+			case LibFunc_closedir:
+				return true;
+			default:
+				break;
 			}
-			else if (t->isFloatTy())
+
+			// A library call only reaches the program's code through a
+			// function pointer argument (qsort, __cxa_atexit, ...). With
+			// opaque pointers the type doesn't tell function pointers from
+			// data, so any pointer not known to point to data counts.
+			for (Value *arg : call->args())
 			{
-				return 32;
+				auto type = dyn_cast<PointerType>(arg->getType());
+				if (!type)
+				{
+					continue;
+				}
+				const Value *object = getUnderlyingObject(arg);
+				if (isa<Function>(object))
+				{
+					return true;
+				}
+				if (type->isOpaque() ? !isIdentifiedObject(object) : type->getNonOpaquePointerElementType()->isFunctionTy())
+				{
+					return true;
+				}
 			}
-			else if (t->isDoubleTy())
+			return false;
+		}
+
+		// Returns true if inst may free or re-poison the memory ptr points
+		// into. A call that may free something still can't free memory it
+		// can't modify, e.g. an alloca whose address never escaped.
+		bool mayFreeMemory(Instruction *inst, Value *ptr)
+		{
+			if (!mayFreeMemory(inst))
 			{
-				return 64;
+				return false;
 			}
-			return 0;
+			AAResults &AA = getAnalysis<AAManager>();
+			return isModSet(AA.getModRefInfo(cast<CallBase>(inst), MemoryLocation::getBeforeOrAfter(ptr)));
 		}
 
 		// Source: LLVM version 16
@@ -126,10 +224,8 @@ namespace
 			return DomBB->getTerminator();
 		}
 
-		BasicBlock *getLikelySuccessor(BasicBlock *bb)
+		BasicBlock *getLikelySuccessor(BranchProbabilityInfo &bpi, BasicBlock *bb)
 		{
-			BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
-
 			BranchProbability maxProbability;
 			BasicBlock *likelySucc = nullptr;
 
@@ -143,7 +239,9 @@ namespace
 				}
 			}
 
-			if (maxProbability >= BranchProbability(4, 5))
+			// whether the trace is worth optimizing is up to the cost model;
+			// this only has to pick a successor that dominates the others
+			if (maxProbability > BranchProbability(1, 2))
 			{
 				return likelySucc;
 			}
@@ -153,616 +251,2521 @@ namespace
 			}
 		}
 
-		// return A - B
-		template <typename T>
-		std::vector<T> setDifference(std::vector<T> &A, std::vector<T> &B)
+		// Block frequencies from before we changed anything, from the PGO
+		// profile when there is one. Blocks we create later take the
+		// frequency of their nearest dominator that has one, which is exact
+		// for the blocks that splitting leaves behind.
+		std::unordered_map<BasicBlock *, uint64_t> blockFreq;
+
+		uint64_t getFrequency(BasicBlock *BB)
 		{
-			std::unordered_set<T> BSet(B.begin(), B.end());
-			std::vector<T> diff;
-			for (const T &val : A)
+			DominatorTree &DT = getAnalysis<DominatorTreeAnalysis>();
+			for (DomTreeNode *node = DT.getNode(BB); node; node = node->getIDom())
 			{
-				if (BSet.find(val) == BSet.end())
+				auto it = blockFreq.find(node->getBlock());
+				if (it != blockFreq.end())
 				{
-					diff.push_back(val);
+					return it->second;
 				}
 			}
-			return diff;
+			return 0;
+		}
+
+		// Expected number of checks that insts execute.
+		uint64_t getCheckCount(const std::vector<Instruction *> &insts)
+		{
+			uint64_t checks = 0;
+			for (Instruction *inst : insts)
+			{
+				checks = SaturatingAdd(checks, getFrequency(inst->getParent()));
+			}
+			return checks;
+		}
+
+		// Whether a single check in placement is expected to run no more
+		// often than the checks on insts that it replaces.
+		bool isCheaperThan(BasicBlock *placement, const std::vector<Instruction *> &insts)
+		{
+			return getFrequency(placement) <= getCheckCount(insts);
 		}
 
-		// return A + B
-		template <typename Base, typename DerivedA, typename DerivedB>
-		std::vector<Base> setUnion(const std::vector<DerivedA> &A, const std::vector<DerivedB> &B)
+		// Records that the cost model kept inst's check where it was, since
+		// moving it would execute newChecks checks instead of oldChecks.
+		void rejectPlacement(Instruction *inst, uint64_t newChecks, uint64_t oldChecks)
 		{
-			std::unordered_set<Base> union_set;
-			for (const DerivedA &V : A)
+			++NumRejected;
+			getAnalysis<OptimizationRemarkEmitterAnalysis>().emit([&]()
+																  { return OptimizationRemarkMissed(DEBUG_TYPE, "TooCostly", inst)
+																		   << "check not moved: expected checks would go from " << ore::NV("OldChecks", oldChecks)
+																		   << " to " << ore::NV("NewChecks", newChecks); });
+		}
+
+		// The path a loop usually takes: blocks[0] is the header, each block's
+		// likely successor is the next one, and the last one's is the header.
+		struct Trace
+		{
+			std::vector<BasicBlock *> blocks;
+			std::unordered_map<BasicBlock *, unsigned> index;
+
+			bool contains(BasicBlock *BB) const { return index.count(BB); }
+
+			// the block before BB on the trace, going around the back edge
+			// for the header
+			BasicBlock *pred(BasicBlock *BB) const
 			{
-				union_set.insert(static_cast<Base>(V));
+				unsigned i = index.at(BB);
+				return i ? blocks[i - 1] : blocks.back();
 			}
-			for (const DerivedB &V : B)
+
+			bool isEdge(BasicBlock *from, BasicBlock *to) const
 			{
-				union_set.insert(static_cast<Base>(V));
+				return contains(from) && contains(to) && pred(to) == from;
 			}
-			std::vector<Base> vec(union_set.begin(), union_set.end());
-			return vec;
-		}
+		};
 
-		std::vector<LoadInst *> getLoads(std::vector<BasicBlock *> &blocks)
+		// Whether V has the same value in every iteration of L that stays on
+		// the trace as in the iteration before it. Header PHIs qualify if the
+		// trace hands them back their own value; anything else has to be
+		// computed from such values without touching memory.
+		bool isTraceInvariant(Value *V, Loop *L, const Trace &trace, std::unordered_map<Value *, bool> &memo)
 		{
-			std::vector<LoadInst *> loads;
-			for (BasicBlock *bb : blocks)
+			Instruction *I = dyn_cast<Instruction>(V);
+			if (!I || !L->contains(I))
+			{
+				return true;
+			}
+			if (!trace.contains(I->getParent()))
+			{
+				return false;
+			}
+			auto it = memo.find(I);
+			if (it != memo.end())
+			{
+				return it->second;
+			}
+
+			bool invariant;
+			if (PHINode *phi = dyn_cast<PHINode>(I))
 			{
-				for (Instruction &inst : *bb)
+				BasicBlock *header = trace.blocks.front();
+				if (phi->getParent() == header)
 				{
-					LoadInst *loadInst = dyn_cast<LoadInst>(&inst);
-					if (loadInst)
+					Value *next = phi->getIncomingValueForBlock(trace.pred(header));
+					PHINode *nextPhi;
+					while ((nextPhi = dyn_cast<PHINode>(next)) && nextPhi->getParent() != header && trace.contains(nextPhi->getParent()))
 					{
-						loads.push_back(loadInst);
+						next = nextPhi->getIncomingValueForBlock(trace.pred(nextPhi->getParent()));
 					}
+					invariant = next == phi;
+				}
+				else
+				{
+					invariant = isTraceInvariant(phi->getIncomingValueForBlock(trace.pred(phi->getParent())), L, trace, memo);
+				}
+			}
+			else
+			{
+				invariant = !I->mayReadOrWriteMemory() && !I->mayHaveSideEffects();
+				for (Value *op : I->operands())
+				{
+					invariant = invariant && isTraceInvariant(op, L, trace, memo);
 				}
 			}
-			return loads;
+			return memo[I] = invariant;
 		}
 
-		std::vector<StoreInst *> getStores(std::vector<BasicBlock *> &blocks)
+		// Moves every edge from -> to over to newTo, a copy of to, along with
+		// the incoming values of to's PHIs.
+		void redirectEdges(BasicBlock *from, BasicBlock *to, BasicBlock *newTo)
 		{
-			std::vector<StoreInst *> stores;
-			for (BasicBlock *bb : blocks)
+			unsigned edges = 0;
+			for (BasicBlock *succ : successors(from))
+			{
+				edges += succ == to;
+			}
+			for (auto [phi, newPhi] : zip(to->phis(), newTo->phis()))
 			{
-				for (Instruction &inst : *bb)
+				Value *incoming = phi.getIncomingValueForBlock(from);
+				for (unsigned i = 0; i < edges; ++i)
 				{
-					StoreInst *storeInst = dyn_cast<StoreInst>(&inst);
-					if (storeInst)
-					{
-						stores.push_back(storeInst);
-					}
+					phi.removeIncomingValue(from, false);
+					newPhi.addIncoming(incoming, from);
 				}
 			}
-			return stores;
+			from->getTerminator()->replaceSuccessorWith(to, newTo);
 		}
 
-		Instruction *getDef(Value *V, Function &F)
+		// Every loop in the function, inner loops before the loops that
+		// contain them.
+		std::vector<Loop *> getLoopsInnermostFirst()
 		{
-			for (BasicBlock &BB : F)
+			LoopInfo &LI = getAnalysis<LoopAnalysis>();
+			SmallVector<Loop *, 8> preorder = LI.getLoopsInPreorder();
+			return std::vector<Loop *>(preorder.rbegin(), preorder.rend());
+		}
+
+		bool loopMayFree(Loop *L)
+		{
+			for (BasicBlock *BB : L->blocks())
 			{
-				for (Instruction &I : BB)
+				for (Instruction &I : *BB)
 				{
-					if (dyn_cast<Value>(&I) == V)
+					if (mayFreeMemory(&I))
 					{
-						return &I;
+						return true;
 					}
 				}
 			}
-			return nullptr;
+			return false;
 		}
 
-		std::vector<Instruction *> getDeps(Instruction *inst, Function &F)
+		// Whether something in L may not pass control on to the next
+		// instruction: a call that can exit, trap, throw or longjmp. If
+		// so, a trip count only bounds the iterations that run, and a check
+		// that reports in the preheader may report for iterations that
+		// never happen.
+		bool loopMayExitEarly(Loop *L)
 		{
-			std::unordered_set<Instruction *> deps;
-			for (BasicBlock &BB : F)
+			SimpleLoopSafetyInfo safetyInfo;
+			safetyInfo.computeLoopSafetyInfo(L);
+			return safetyInfo.anyBlockMayThrow();
+		}
+
+		// A check placed in L's preheader can move out to the preheader of
+		// an enclosing loop P if it is invariant in P, P can't free memory,
+		// and L is entered on every iteration of P. Returns the outermost
+		// loop we can reach this way (L itself if we can't move it).
+		template <typename InvariantFn>
+		Loop *getHoistTarget(Loop *L, InvariantFn isInvariant)
+		{
+			DominatorTree &DT = getAnalysis<DominatorTreeAnalysis>();
+
+			Loop *target = L;
+			while (Loop *P = target->getParentLoop())
 			{
-				for (Instruction &I : BB)
+				if (!P->getLoopPreheader() || loopMayFree(P) || !isInvariant(P))
 				{
-					// follow use-chains and check if there's a path to inst
-					std::unordered_set<Instruction *> visited;
-					std::vector<Instruction *> stack;
-					stack.push_back(&I);
-
-					while (!stack.empty())
-					{
-						Instruction *top = stack.back();
-						stack.pop_back();
-						if (top == inst)
-						{
-							// we found a path to inst
-							deps.insert(&I);
-							break;
-						}
-						if (!visited.insert(top).second)
-							continue;
-						for (User *U : top->users())
-						{
-							Instruction *userInst = dyn_cast<Instruction>(U);
-							if (!userInst)
-								continue;
-							stack.push_back(userInst);
-						}
-					}
+					break;
+				}
+				SimpleLoopSafetyInfo safetyInfo;
+				safetyInfo.computeLoopSafetyInfo(P);
+				if (!safetyInfo.isGuaranteedToExecute(*target->getLoopPreheader()->getTerminator(), &DT, P))
+				{
+					break;
 				}
+				target = P;
 			}
-			return std::vector<Instruction *>(deps.begin(), deps.end());
+			return target;
 		}
 
-		void removeBlocksFromPhi(PHINode *phi, BasicBlock *block)
+		// void *__asan_region_is_poisoned(void *beg, uptr size)
+		FunctionCallee getRegionIsPoisoned(Module &M)
 		{
-			for (unsigned int i = 0; i < phi->getNumIncomingValues(); ++i)
+			LLVMContext &context = M.getContext();
+			Type *intPtrTy = M.getDataLayout().getIntPtrType(context);
+			FunctionType *fty = FunctionType::get(Type::getInt8PtrTy(context), {Type::getInt8PtrTy(context), intPtrTy}, false);
+			// only reads shadow memory, so it doesn't stop checks from being
+			// hoisted past it
+			AttributeList attrs = AttributeList::get(context, AttributeList::FunctionIndex,
+													 {Attribute::NoFree, Attribute::NoUnwind, Attribute::WillReturn,
+													  Attribute::ReadOnly, Attribute::InaccessibleMemOnly});
+			return M.getOrInsertFunction("__asan_region_is_poisoned", fty, attrs);
+		}
+
+		// void __asan_report_{load,store}_n(uptr addr, uptr size)
+		FunctionCallee getReport(Module &M, bool isWrite)
+		{
+			LLVMContext &context = M.getContext();
+			Type *intPtrTy = M.getDataLayout().getIntPtrType(context);
+			FunctionType *fty = FunctionType::get(Type::getVoidTy(context), {intPtrTy, intPtrTy}, false);
+			AttributeList attrs = AttributeList::get(context, AttributeList::FunctionIndex,
+													 {Attribute::NoReturn, Attribute::NoUnwind, Attribute::Cold});
+			return M.getOrInsertFunction(isWrite ? "__asan_report_store_n" : "__asan_report_load_n", fty, attrs);
+		}
+
+		// Calls __asan_region_is_poisoned(begin, size) before insertPt. If
+		// guard is non-null, the call only happens when guard is true.
+		//
+		// The region is covered by width byte accesses stride bytes apart,
+		// starting at begin, on behalf of insts. When part of it is
+		// poisoned, a cold block reports the access that contains the first
+		// poisoned byte and doesn't return. A zero stride reports the
+		// poisoned byte itself. The report points at the source location of
+		// the first of insts, so it names the same site as their own checks
+		// would have.
+		void insertRegionCheck(Instruction *insertPt, Value *begin, Value *size, unsigned width, uint64_t stride, const std::vector<Instruction *> &insts, Value *guard = nullptr)
+		{
+			DominatorTree &DT = getAnalysis<DominatorTreeAnalysis>();
+			LoopInfo &LI = getAnalysis<LoopAnalysis>();
+			LLVMContext &context = insertPt->getContext();
+			Module &M = *insertPt->getModule();
+			Type *intPtrTy = M.getDataLayout().getIntPtrType(context);
+
+			if (guard)
 			{
-				if (phi->getIncomingBlock(i) == block)
-				{
-					phi->removeIncomingValue(i);
-					--i;
-				}
+				insertPt = SplitBlockAndInsertIfThen(guard, insertPt, false, nullptr, &DT, &LI);
+			}
+
+			IRBuilder<> builder(insertPt);
+			Value *ptr = builder.CreatePointerCast(begin, Type::getInt8PtrTy(context));
+			Value *poisoned = builder.CreateCall(getRegionIsPoisoned(M), {ptr, builder.CreateZExtOrTrunc(size, intPtrTy)});
+			Value *cond = builder.CreateIsNotNull(poisoned);
+
+			MDNode *weights = MDBuilder(context).createBranchWeights(1, (1U << 20) - 1);
+			Instruction *checkTerm = SplitBlockAndInsertIfThen(cond, insertPt, true, weights, &DT, &LI);
+			checkTerm->getParent()->setName("asan.report");
+			builder.SetInsertPoint(checkTerm);
+			Value *addr = builder.CreatePtrToInt(poisoned, intPtrTy);
+			if (stride)
+			{
+				Value *base = builder.CreatePtrToInt(ptr, intPtrTy);
+				Value *strideVal = ConstantInt::get(intPtrTy, stride);
+				Value *index = builder.CreateUDiv(builder.CreateSub(addr, base), strideVal);
+				addr = builder.CreateAdd(base, builder.CreateMul(index, strideVal));
 			}
+			CallInst *report = builder.CreateCall(getReport(M, allStores(insts)), {addr, ConstantInt::get(intPtrTy, width)});
+			report->setDoesNotReturn();
+			report->setDebugLoc(insts.front()->getDebugLoc());
+			// otherwise ASan unpoisons the stack before this noreturn call,
+			// and the report can't tell what kind of bug it is
+			report->setMetadata(LLVMContext::MD_nosanitize, MDNode::get(context, MDString::get(context, "nosanitize")));
 		}
 
-		void frequentPathOptimization(Function &F)
+		// Calls __asan_region_is_poisoned(begin, size) before insertPt.
+		// Returns an i1 that is true if the whole region is addressable.
+		Value *insertRegionQuery(Instruction *insertPt, Value *begin, Value *size)
 		{
-			/**
-			 * Loop optimization: This optimization will move ASan
-			 * instrumentation code off of the frequent path and onto the
-			 * infrequent path for basic loops.
-			 *
-			 * We also need to unroll the loop once for correctness (so we can
-			 * always instrument the first access).
-			 */
+			LLVMContext &context = insertPt->getContext();
+			Module &M = *insertPt->getModule();
+			Type *intPtrTy = M.getDataLayout().getIntPtrType(context);
+			IRBuilder<> builder(insertPt);
+			Value *ptr = builder.CreatePointerCast(begin, Type::getInt8PtrTy(context));
+			Value *poisoned = builder.CreateCall(getRegionIsPoisoned(M), {ptr, builder.CreateZExtOrTrunc(size, intPtrTy)});
+			return builder.CreateIsNull(poisoned, "asan.safe");
+		}
 
-			LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+		// A hoisted check reports a store only if every access it replaces
+		// is a store; otherwise the first bad access may be a load.
+		static bool allStores(const std::vector<Instruction *> &insts)
+		{
+			return std::all_of(insts.begin(), insts.end(), [](Instruction *I)
+							   { return isa<StoreInst>(I); });
+		}
 
-			LLVMContext &context = F.getContext();
+		// insts are accesses in one block, in order. Replaces the stretch of
+		// the block from the first to the last of them with
+		//   if (safe) <stretch, insts nosanitize> else <stretch, checked>
+		// Updates LoopInfo, but the caller has to recalculate DT.
+		void versionAccesses(const std::vector<Instruction *> &insts, Value *safe)
+		{
+			LoopInfo &LI = getAnalysis<LoopAnalysis>();
+			LLVMContext &context = safe->getContext();
 			MDNode *nosanitize = MDNode::get(context, MDString::get(context, "nosanitize"));
+			MDNode *weights = MDBuilder(context).createBranchWeights(1000, 1);
 
-			for (Loop *L : LI)
+			BasicBlock *head = insts.front()->getParent();
+			Function *F = head->getParent();
+			Loop *L = LI.getLoopFor(head);
+			BasicBlock *fast = SplitBlock(head, insts.front(), static_cast<DominatorTree *>(nullptr), &LI);
+			BasicBlock *tail = SplitBlock(fast, insts.back()->getNextNode(), static_cast<DominatorTree *>(nullptr), &LI);
+
+			ValueToValueMapTy vmap;
+			BasicBlock *slow = CloneBasicBlock(fast, vmap, ".asan.checked", F);
+			for (Instruction &I : *slow)
 			{
-				BasicBlock *header = L->getHeader();
+				RemapInstruction(&I, vmap, RF_IgnoreMissingLocals | RF_NoModuleLevelChanges);
+			}
+			if (L)
+			{
+				L->addBasicBlockToLoop(slow, LI);
+			}
+
+			head->getTerminator()->eraseFromParent();
+			BranchInst::Create(fast, slow, safe, head)->setMetadata(LLVMContext::MD_prof, weights);
 
-				// capture all BBs in loop
-				std::vector<BasicBlock *> loopBlocks;
+			// values defined in the stretch and used after it now come from
+			// either copy
+			for (Instruction &I : *fast)
+			{
+				if (I.isTerminator() || I.getType()->isVoidTy())
 				{
-					std::unordered_set<BasicBlock *> visited;
-					std::vector<BasicBlock *> stack;
-					stack.push_back(header);
-					while (!stack.empty())
-					{
-						BasicBlock *top = stack.back();
-						stack.pop_back();
-						if (!visited.insert(top).second)
-						{
-							continue;
-						}
-						for (BasicBlock *succ : successors(top))
-						{
-							if (L->contains(succ))
-							{
-								stack.push_back(succ);
-							}
-						}
-					}
-					loopBlocks = std::vector<BasicBlock *>(visited.begin(), visited.end());
+					continue;
 				}
-
-				// populate trace by following frequent path
-				std::vector<BasicBlock *> traceBlocks;
+				Value *clone = vmap[&I];
+				PHINode *phi = PHINode::Create(I.getType(), 2, "", &tail->front());
+				I.replaceUsesWithIf(phi, [&](Use &U)
+									{ BasicBlock *user = cast<Instruction>(U.getUser())->getParent();
+									  return user != fast && user != slow; });
+				phi->addIncoming(&I, fast);
+				phi->addIncoming(clone, slow);
+				if (phi->use_empty())
 				{
-					BasicBlock *curr = header;
-					do
-					{
-						assert(L->contains(curr));
-						traceBlocks.push_back(curr);
-						curr = getLikelySuccessor(curr);
-					} while (curr != header);
+					phi->eraseFromParent();
 				}
+			}
 
-				std::vector<BasicBlock *> infrequentBlocks = setDifference(loopBlocks, traceBlocks);
+			for (Instruction *inst : insts)
+			{
+				inst->setMetadata(LLVMContext::MD_nosanitize, nosanitize);
+			}
+		}
 
-				for (BasicBlock *block : traceBlocks)
-				{
-					for (Instruction &I : *block)
-					{
-						I.setMetadata("TRACE", MDNode::get(context, MDString::get(context, "TRACE")));
-					}
-				}
+		// block -> (accesses to version, whether all their queries found
+		// their memory addressable)
+		using VersionedBlocks = MapVector<BasicBlock *, std::pair<std::vector<Instruction *>, Value *>>;
 
-				for (BasicBlock *block : infrequentBlocks)
+		// Adds insts, accesses in L, to be versioned on safe. An access's
+		// block runs unchecked only if every query of its accesses is safe,
+		// so the conditions are and-ed in L's preheader, after the queries.
+		void addVersionedAccesses(VersionedBlocks &blocks, Loop *L, const std::vector<Instruction *> &insts, Value *safe)
+		{
+			for (Instruction *inst : insts)
+			{
+				auto &[blockInsts, blockSafe] = blocks[inst->getParent()];
+				blockInsts.push_back(inst);
+				if (!blockSafe)
 				{
-					for (Instruction &I : *block)
-					{
-						I.setMetadata("INFREQ", MDNode::get(context, MDString::get(context, "INFREQ")));
-					}
+					blockSafe = safe;
 				}
-
-				// find memory instructions in trace whose addresses depend on infrequently-changed addresses
-				std::vector<Instruction *> memInsts = setUnion<Instruction *>(getStores(traceBlocks), getLoads(traceBlocks));
-				std::unordered_set<BasicBlock *> infreqDepBlocks;
-				std::unordered_set<Instruction *> noSanitizeMemInsts;
-
-				for (Instruction *memInst : memInsts)
+				else if (blockSafe != safe)
 				{
-					Value *ptr = nullptr;
-					if (StoreInst *store = dyn_cast<StoreInst>(memInst))
-					{
-						ptr = store->getPointerOperand();
-					}
-					else if (LoadInst *load = dyn_cast<LoadInst>(memInst))
-					{
-						ptr = load->getPointerOperand();
-					}
-
-					Instruction *ptrInst = getDef(ptr, F);
-					if (!ptrInst)
-						continue;
-
-					errs() << "Found memory instruction\n";
-					errs() << *memInst << "\n";
+					blockSafe = BinaryOperator::CreateAnd(blockSafe, safe, "asan.safe", L->getLoopPreheader()->getTerminator());
+				}
+			}
+		}
 
-					// check if the ptrInst dependends on infrequent path
-					Instruction *infreqDep = nullptr;
-					std::vector<Instruction *> deps = getDeps(ptrInst, F);
-					for (Instruction *dep : deps)
-					{
-						errs() << "Dep: " << *dep << "\n";
-						bool isInfreq = false;
-						for (BasicBlock *infreqBlock : infrequentBlocks)
-						{
-							if (dep->getParent() == infreqBlock)
-							{
-								isInfreq = true;
-								break;
-							}
-						}
+		// Versions the accesses of each block in L on their condition, then
+		// brings DT and SE up to date.
+		void versionBlocks(VersionedBlocks &blocks, Loop *L)
+		{
+			if (blocks.empty())
+			{
+				return;
+			}
+			for (auto &[BB, blockAccesses] : blocks)
+			{
+				auto &[insts, safe] = blockAccesses;
+				std::sort(insts.begin(), insts.end(), [](Instruction *a, Instruction *b)
+						  { return a->comesBefore(b); });
+				versionAccesses(insts, safe);
+			}
+			getAnalysis<DominatorTreeAnalysis>().recalculate(*L->getHeader()->getParent());
+			getAnalysis<ScalarEvolutionAnalysis>().forgetLoop(L);
+		}
 
-						if (isInfreq)
-						{
-							infreqDep = dep;
-							break;
-						}
-					}
-					if (!infreqDep)
-						continue;
+		// Returns how many times BB executes each time L is entered, or
+		// nullptr if we can't tell. The result is an i64 SCEV. If
+		// loopMayExitEarly(L), it is only an upper bound.
+		const SCEV *getExecutionCount(Loop *L, BasicBlock *BB)
+		{
+			DominatorTree &DT = getAnalysis<DominatorTreeAnalysis>();
+			ScalarEvolution &SE = getAnalysis<ScalarEvolutionAnalysis>();
 
-					// only perform the optimization if the dependency is in a block immediately preceding the memory instruction
-					// the dependency block also needs to only have one successor (so we can duplicate the successor with the instrumentation)
-					BasicBlock *depBlock = infreqDep->getParent();
-					BasicBlock *memBlock = memInst->getParent();
-					if (depBlock->getSingleSuccessor() != memBlock)
-					{
-						errs() << "Optimization cancelled because of successor requirement\n";
-						continue;
-					}
+			BasicBlock *exiting = L->getExitingBlock();
+			BasicBlock *latch = L->getLoopLatch();
+			if (!exiting || !latch || !DT.dominates(BB, latch))
+			{
+				return nullptr;
+			}
 
-					errs() << "Performing frequent-path loop optimization\n";
+			const SCEV *btc = SE.getBackedgeTakenCount(L);
+			if (isa<SCEVCouldNotCompute>(btc))
+			{
+				return nullptr;
+			}
+			Type *i64 = Type::getInt64Ty(BB->getContext());
+			btc = SE.getNoopOrZeroExtend(btc, i64);
 
-					infreqDepBlocks.insert(depBlock);
-					noSanitizeMemInsts.insert(memInst);
-				}
+			// BB runs before the exit test, including on the last iteration
+			if (DT.dominates(BB, exiting))
+			{
+				return SE.getAddExpr(btc, SE.getOne(i64));
+			}
+			// BB runs after the exit test, so the last iteration skips it
+			if (DT.dominates(exiting, BB))
+			{
+				return btc;
+			}
+			return nullptr;
+		}
 
-				// re-add instrumentation for infreq deps by duplicating their successors
-				for (BasicBlock *depBlock : infreqDepBlocks)
+		// Returns the size in bytes of the object base points to, if it is a
+		// fixed-size alloca or global that ASan can only flag for
+		// out-of-bounds accesses.
+		Optional<uint64_t> getStaticObjectSize(Value *base)
+		{
+			const DataLayout &DL = curF->getParent()->getDataLayout();
+			if (auto alloca = dyn_cast<AllocaInst>(base))
+			{
+				// with lifetime markers, ASan also reports use-after-scope
+				std::vector<Value *> stack = {alloca};
+				while (!stack.empty())
 				{
-					ValueToValueMapTy vmap;
-
-					BasicBlock *memBlock = depBlock->getSingleSuccessor();
-					if (memBlock)
-						continue;
-					assert(memBlock);
-
-					BasicBlock *dupMemBlock = CloneBasicBlock(memBlock, vmap, "", &F);
-
-					// make depBlock branch into dupMemBlock
-					BranchInst *br = dyn_cast<BranchInst>(depBlock->getTerminator());
-					for (unsigned int i = 0; i < br->getNumSuccessors(); ++i)
+					Value *top = stack.back();
+					stack.pop_back();
+					for (User *U : top->users())
 					{
-						if (br->getSuccessor(i) == memBlock)
+						if (isa<BitCastInst>(U))
 						{
-							br->setSuccessor(i, dupMemBlock);
+							stack.push_back(U);
 						}
-					}
-
-					// fix phi stuff in dupMemBlock
-					for (Instruction &I : *dupMemBlock)
-					{
-						if (PHINode *phi = dyn_cast<PHINode>(&I))
+						else if (auto intrinsic = dyn_cast<IntrinsicInst>(U))
 						{
-							errs() << "PHI BEFORE: " << *phi << "\n";
-							for (BasicBlock *pred : predecessors(memBlock))
+							if (intrinsic->isLifetimeStartOrEnd())
 							{
-								if (pred != depBlock)
-								{
-									removeBlocksFromPhi(phi, pred);
-								}
+								return None;
 							}
-							errs() << "PHI AFTER: " << *phi << "\n";
 						}
 					}
-
-					// fix phi stuff in successors
-					for (BasicBlock *succ : successors(dupMemBlock))
+				}
+				if (auto bits = alloca->getAllocationSizeInBits(DL))
+				{
+					if (!bits->isScalable())
 					{
-						for (Instruction &I : *succ)
-						{
-							if (PHINode *phi = dyn_cast<PHINode>(&I))
-							{
-								Value *originalValue = phi->getIncomingValueForBlock(memBlock);
-								Value *mappedValue = vmap[originalValue];
-								phi->addIncoming(mappedValue, dupMemBlock);
-							}
-						}
+						return bits->getFixedSize() / 8;
 					}
-
-					// iterate through successors
-					/* auto it = std::next(block->getIterator());
-					BasicBlock *lastBlock = *(L->getBlocks().rbegin());
-					while (&*it != &*lastBlock)
-					{
-						BasicBlock *curr = &*it;
-						BasicBlock *clone = CloneBasicBlock(curr, vmap);
-						// curr->getSinglePredecessor()->replaceSuccessorsPhiUsesWith();
-
-						// replace all branches into curr into branches into clone
-						for (BasicBlock *pred : predecessors(curr))
-						{
-							BranchInst *br = dyn_cast<BranchInst>(pred->getTerminator());
-							assert(br);
-							for (unsigned int i = 0; i < br->getNumSuccessors(); ++i)
-							{
-							}
-						}
-						++it;
-					} */
 				}
-
-				// disable instrumentation on selected mem insts
-				for (Instruction *inst : noSanitizeMemInsts)
+				return None;
+			}
+			if (auto global = dyn_cast<GlobalVariable>(base))
+			{
+				// the definition we'd link against might be a different size
+				if (global->isDeclaration() || global->isInterposable())
 				{
-					// inst->setMetadata(LLVMContext::MD_nosanitize, nosanitize);
+					return None;
 				}
+				return DL.getTypeAllocSize(global->getValueType()).getFixedSize();
 			}
+			return None;
 		}
 
-		void invariantAddressOptimization(Function &F)
+		// Returns the size in bytes of the heap object base points to, if
+		// base is the result of malloc or operator new. The result is a
+		// SCEV of the size argument.
+		const SCEV *getHeapObjectSize(Value *base)
 		{
-			/**
-			 * Invariant address optimization: If a memory instruction is
-			 * issued to an invariant address w.r.t. the loop, we hoist the
-			 * check into the preheader.
-			 *
-			 * This is useful because classical optimizations can't hoist
-			 * things like stores, and we also don't want to check shadow mem
-			 * each time.
-			 */
-
-			LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
-
-			LLVMContext &context = F.getContext();
-			MDNode *nosanitize = MDNode::get(context, MDString::get(context, "nosanitize"));
-
-			for (Loop *L : LI)
+			TargetLibraryInfo &TLI = getAnalysis<TargetLibraryAnalysis>();
+			auto call = dyn_cast<CallBase>(base);
+			Function *callee = call ? call->getCalledFunction() : nullptr;
+			LibFunc func;
+			if (!callee || !TLI.getLibFunc(*callee, func))
+			{
+				return nullptr;
+			}
+			switch (func)
 			{
-				// TODO
+			case LibFunc_malloc:
+			case LibFunc_Znwm:
+			case LibFunc_Znam:
+			case LibFunc_Znwj:
+			case LibFunc_Znaj:
+				return getAnalysis<ScalarEvolutionAnalysis>().getSCEV(call->getArgOperand(0));
+			default:
+				return nullptr;
 			}
 		}
 
-		bool runOnFunction(Function &F) override
+		// Returns true if [offset, offset + width) is inside [0, size)
+		// for every value offset takes at inst. An affine offset in a loop
+		// with a computable trip count goes from its start on the first
+		// iteration to its value on the last.
+		bool isWithin(const SCEV *offset, unsigned width, const SCEV *size, Instruction *inst)
 		{
-			errs() << "Running OptimizeASan pass on ";
-			errs().write_escaped(F.getName()) << '\n';
-
-			// AAResults &AAResult = getAnalysis<AAResultsWrapperPass>().getAAResults();
-			DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
-			ScalarEvolution &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
-			LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
-			DependenceInfo &DI = getAnalysis<llvm::DependenceAnalysisWrapperPass>().getDI();
+			ScalarEvolution &SE = getAnalysis<ScalarEvolutionAnalysis>();
+			Type *ty = offset->getType();
+			if (size->getType() != ty)
+			{
+				return false;
+			}
 
-			LLVMContext &context = F.getContext();
-			MDNode *nosanitize = MDNode::get(context, MDString::get(context, "nosanitize"));
+			const SCEV *first = offset;
+			const SCEV *last = offset;
+			if (auto rec = dyn_cast<SCEVAddRecExpr>(offset))
+			{
+				// without no-wrap flags, the offset may wrap around on the
+				// way to its last value
+				const SCEV *btc = SE.getBackedgeTakenCount(rec->getLoop());
+				if (!rec->isAffine() || isa<SCEVCouldNotCompute>(btc) || !rec->hasNoUnsignedWrap() ||
+					!SE.isKnownNonNegative(rec->getStepRecurrence(SE)))
+				{
+					return false;
+				}
+				first = rec->getStart();
+				last = rec->evaluateAtIteration(SE.getNoopOrZeroExtend(btc, ty), SE);
+			}
+			if (!SE.isKnownNonNegative(first))
+			{
+				return false;
+			}
+			if (SE.isKnownPredicateAt(ICmpInst::ICMP_ULE, SE.getAddExpr(last, SE.getConstant(ty, width)), size, inst))
+			{
+				return true;
+			}
 
-			Module *M = F.getParent();
-			std::vector<Type *> params = {Type::getInt32PtrTy(context), Type::getInt64Ty(context)};
-			FunctionType *fty = FunctionType::get(Type::getInt32PtrTy(context), ArrayRef<Type *>(params), false);
-			auto callee = M->getOrInsertFunction("__asan_region_is_poisoned", fty, AttributeList());
-			Value *arip = callee.getCallee();
-			arip->print(errs());
+			// malloc(n * 4) accessed as p[i] for i < n: the sizes are
+			// C * x and C * y, and SCEV can't see through the products. If
+			// C * y doesn't wrap, x < y is enough for C * x + width <= C * y.
+			auto lastMul = dyn_cast<SCEVMulExpr>(last);
+			auto sizeMul = dyn_cast<SCEVMulExpr>(size);
+			if (!lastMul || !sizeMul || lastMul->getNumOperands() != 2 || sizeMul->getNumOperands() != 2 ||
+				lastMul->getOperand(0) != sizeMul->getOperand(0) || !lastMul->hasNoUnsignedWrap())
+			{
+				return false;
+			}
+			auto scale = dyn_cast<SCEVConstant>(sizeMul->getOperand(0));
+			const SCEV *x = lastMul->getOperand(1);
+			const SCEV *y = sizeMul->getOperand(1);
+			bool sizeNoWrap = sizeMul->hasNoUnsignedWrap() ||
+							  (sizeMul->hasNoSignedWrap() && SE.isKnownPredicateAt(ICmpInst::ICMP_SGE, y, SE.getZero(ty), inst));
+			if (!scale || !scale->getAPInt().isNonNegative() || scale->getAPInt().ult(width) || !sizeNoWrap)
+			{
+				return false;
+			}
 
-			for (auto &L : LI)
+			// zext i32 (n - 1) < sext i32 n: compare the i32 values, which
+			// extend the same way as long as they are non-negative
+			auto narrow = [&](const SCEV *S) -> const SCEV *
 			{
-				if (!L->isCanonical(SE))
+				if (auto zext = dyn_cast<SCEVZeroExtendExpr>(S))
 				{
-					continue;
+					return zext->getOperand();
 				}
-
-				BasicBlock *preheader = L->getLoopPreheader();
-				BasicBlock *ppheader = preheader->splitBasicBlock(preheader->getTerminator(), "", true);
-				BasicBlock *header = L->getHeader();
-				long long finalIVVal;
-				Optional<Loop::LoopBounds> option = L->getBounds(SE);
-				if (option != None)
+				if (auto sext = dyn_cast<SCEVSignExtendExpr>(S))
+				{
+					const SCEV *op = sext->getOperand();
+					return SE.isKnownPredicateAt(ICmpInst::ICMP_SGE, op, SE.getZero(op->getType()), inst) ? op : nullptr;
+				}
+				return nullptr;
+			};
+			const SCEV *narrowX = narrow(x);
+			const SCEV *narrowY = narrow(y);
+			if (narrowX && narrowY && narrowX->getType() == narrowY->getType())
+			{
+				x = narrowX;
+				y = narrowY;
+			}
+			// x = y - c doesn't wrap if y >= c, which SCEV doesn't try
+			auto diff = dyn_cast<SCEVConstant>(SE.getMinusSCEV(y, x));
+			if (diff && diff->getAPInt().isStrictlyPositive() && SE.isKnownPredicateAt(ICmpInst::ICMP_UGE, y, diff, inst))
+			{
+				return true;
+			}
+			return SE.isKnownPredicateAt(ICmpInst::ICMP_ULT, x, y, inst);
+		}
+
+		// Returns the signed range of the integer V. On top of what SCEV
+		// knows, a remainder by a constant is smaller than the divisor, and
+		// an srem of a non-negative value is non-negative.
+		ConstantRange getValueRange(Value *V)
+		{
+			using namespace PatternMatch;
+			ScalarEvolution &SE = getAnalysis<ScalarEvolutionAnalysis>();
+			unsigned bits = V->getType()->getIntegerBitWidth();
+			ConstantRange range = SE.getSignedRange(SE.getSCEV(V));
+
+			Value *X;
+			const APInt *C;
+			if (match(V, m_SExt(m_Value(X))))
+			{
+				range = range.intersectWith(getValueRange(X).signExtend(bits), ConstantRange::Signed);
+			}
+			else if (match(V, m_ZExt(m_Value(X))))
+			{
+				range = range.intersectWith(getValueRange(X).zeroExtend(bits), ConstantRange::Signed);
+			}
+			else if (match(V, m_SRem(m_Value(X), m_APInt(C))) && !C->isZero() && !C->isMinSignedValue())
+			{
+				// the remainder takes the sign of X
+				APInt abs = C->abs();
+				ConstantRange rem = SE.isKnownNonNegative(SE.getSCEV(X)) ? ConstantRange(APInt::getZero(bits), abs)
+																		 : ConstantRange(1 - abs, abs);
+				range = range.intersectWith(rem, ConstantRange::Signed);
+			}
+			else if (match(V, m_URem(m_Value(X), m_APInt(C))) && !C->isZero())
+			{
+				range = range.intersectWith(ConstantRange(APInt::getZero(bits), *C), ConstantRange::Signed);
+			}
+			return range;
+		}
+
+		// Follows the GEPs addr is computed with back to the pointer they
+		// start from, which goes in base, and returns the signed range of
+		// addr's offset in bytes from it.
+		Optional<ConstantRange> getOffsetRange(Value *addr, Value *&base)
+		{
+			const DataLayout &DL = curF->getParent()->getDataLayout();
+			unsigned bits = DL.getIndexTypeSizeInBits(addr->getType());
+			ConstantRange offset(APInt::getZero(bits));
+
+			Value *ptr = addr->stripPointerCasts();
+			while (auto gep = dyn_cast<GEPOperator>(ptr))
+			{
+				for (gep_type_iterator it = gep_type_begin(gep), end = gep_type_end(gep); it != end; ++it)
 				{
-					Loop::LoopBounds bounds = *option;
-					if (auto ci = dyn_cast<ConstantInt>(&bounds.getFinalIVValue()))
+					if (StructType *structTy = it.getStructTypeOrNull())
 					{
-						finalIVVal = ci->getSExtValue();
+						uint64_t field = cast<ConstantInt>(it.getOperand())->getZExtValue();
+						offset = offset.add(ConstantRange(APInt(bits, DL.getStructLayout(structTy)->getElementOffset(field))));
+						continue;
 					}
-					else
+					TypeSize size = DL.getTypeAllocSize(it.getIndexedType());
+					if (size.isScalable() || !it.getOperand()->getType()->isIntegerTy())
+					{
+						return None;
+					}
+					ConstantRange index = getValueRange(it.getOperand()).sextOrTrunc(bits);
+					offset = offset.add(index.multiply(ConstantRange(APInt(bits, size.getFixedSize()))));
+				}
+				ptr = gep->getPointerOperand()->stripPointerCasts();
+			}
+			base = ptr;
+			return offset;
+		}
+
+		void inBoundsCheckElimination(Function &F)
+		{
+			/**
+			 * In-bounds check elimination: if SCEV can bound the offset of
+			 * an access into a fixed-size alloca or global, and the whole
+			 * range is inside the object, the check can never fire. Indices
+			 * that are remainders by a constant are bounded by it.
+			 *
+			 * The same goes for memory from malloc or new in this function,
+			 * if nothing between the allocation and the access may free it.
+			 * The size can be symbolic (malloc(n * 4) accessed as p[i] for
+			 * i < n) as long as SCEV can prove the offset stays below it.
+			 */
+
+			DominatorTree &DT = getAnalysis<DominatorTreeAnalysis>();
+			ScalarEvolution &SE = getAnalysis<ScalarEvolutionAnalysis>();
+			OptimizationRemarkEmitter &ORE = getAnalysis<OptimizationRemarkEmitterAnalysis>();
+
+			LLVMContext &context = F.getContext();
+			MDNode *nosanitize = MDNode::get(context, MDString::get(context, "nosanitize"));
+
+			for (Instruction &I : instructions(F))
+			{
+				auto [addr, width] = getCheckedAccess(&I);
+				if (!addr)
+				{
+					continue;
+				}
+
+				const SCEV *ptr = SE.getSCEV(addr);
+				auto base = dyn_cast<SCEVUnknown>(SE.getPointerBase(ptr));
+				if (!base)
+				{
+					continue;
+				}
+				const SCEV *offset = SE.removePointerBase(ptr);
+				Value *object = base->getValue();
+				Optional<uint64_t> size = getStaticObjectSize(object);
+				bool heap = false;
+				bool inBounds = false;
+				if (!size)
+				{
+					// heap memory is only addressable from its allocation
+					// until it is freed
+					const SCEV *heapSize = getHeapObjectSize(object);
+					if (!heapSize || !DT.dominates(object, &I) || mayFreeBetween(cast<Instruction>(object), &I, object))
 					{
 						continue;
 					}
+					heap = true;
+					auto constant = dyn_cast<SCEVConstant>(heapSize);
+					if (constant && constant->getAPInt().getActiveBits() <= 64)
+					{
+						size = constant->getAPInt().getZExtValue();
+					}
+					else
+					{
+						inBounds = isWithin(offset, width, heapSize, &I);
+					}
+				}
+
+				if (size)
+				{
+					// SCEV can't see that C[h % 1000] stays in [0, 1000)
+					ConstantRange range = SE.getSignedRange(offset);
+					Value *gepBase;
+					Optional<ConstantRange> gepRange = getOffsetRange(addr, gepBase);
+					if (gepRange && gepBase == object)
+					{
+						range = range.intersectWith(*gepRange, ConstantRange::Signed);
+					}
+					inBounds = !range.isFullSet() && !range.getSignedMin().isNegative() &&
+							   (range.getSignedMax().sext(128) + width).ule(*size);
+				}
+				if (!inBounds)
+				{
+					continue;
+				}
+
+				I.setMetadata(LLVMContext::MD_nosanitize, nosanitize);
+				if (heap)
+				{
+					++NumHeapInBounds;
 				}
 				else
+				{
+					++NumInBounds;
+				}
+				ORE.emit([&]()
+						 { return OptimizationRemark(DEBUG_TYPE, "InBounds", &I)
+								  << "check removed: access is always within " << ore::NV("Object", object); });
+			}
+		}
+
+		void rangeCheckOptimization(Function &F)
+		{
+			/**
+			 * Range check optimization: If a loop walks an array with a
+			 * constant stride, we check the whole range it touches once in
+			 * the preheader instead of checking every element.
+			 *
+			 * The range comes from the backedge-taken count, so it works for
+			 * symbolic trip counts (n, size(), end - begin) as well as
+			 * constant ones.
+			 *
+			 * Accesses in blocks that run on every iteration get a hoisted
+			 * check that reports. Conditionally executed accesses may never
+			 * touch parts of the range, so for those the preheader only
+			 * computes whether the range over all iterations is addressable,
+			 * and each access branches to an unchecked copy when it is. The
+			 * same goes for every access in a loop that may be left early
+			 * through a call that doesn't return.
+			 */
+
+			ScalarEvolution &SE = getAnalysis<ScalarEvolutionAnalysis>();
+			LoopInfo &LI = getAnalysis<LoopAnalysis>();
+			OptimizationRemarkEmitter &ORE = getAnalysis<OptimizationRemarkEmitterAnalysis>();
+			const DataLayout &DL = F.getParent()->getDataLayout();
+
+			LLVMContext &context = F.getContext();
+			MDNode *nosanitize = MDNode::get(context, MDString::get(context, "nosanitize"));
+			Type *i64 = Type::getInt64Ty(context);
+
+			for (Loop *L : getLoopsInnermostFirst())
+			{
+				BasicBlock *preheader = L->getLoopPreheader();
+				if (!preheader || loopMayFree(L))
 				{
 					continue;
 				}
-				// Just look at the first basic block because it would
-				// get complicated with branches
-				BasicBlock *BB = *(L->block_begin());
-				for (auto &inst : *BB)
+
+				// the header runs on every iteration, so its count bounds the
+				// iterations a conditional access can run on
+				const SCEV *headerCount = getExecutionCount(L, L->getHeader());
+				if (headerCount && !SE.isKnownPositive(headerCount))
+				{
+					headerCount = nullptr;
+				}
+				bool mayExitEarly = loopMayExitEarly(L);
+
+				// (address, execution count) -> accesses. A null count means
+				// the accesses are conditional.
+				struct RangeAccesses
 				{
-					// Give up if there is a branch
-					if (auto gep = dyn_cast<GetElementPtrInst>(&inst))
+					std::vector<Instruction *> insts;
+					unsigned width = 0;
+				};
+				MapVector<std::pair<const SCEVAddRecExpr *, const SCEV *>, RangeAccesses> ranges;
+				for (BasicBlock *BB : L->blocks())
+				{
+					// accesses in inner loops are handled with their own loop
+					if (LI.getLoopFor(BB) != L)
+					{
+						continue;
+					}
+					const SCEV *count = getExecutionCount(L, BB);
+					if (!count && !headerCount)
 					{
-						const SCEV *scevGep = SE.getSCEV(gep);
-						if (auto scevGepADD = dyn_cast<SCEVAddRecExpr>(scevGep))
+						continue;
+					}
+					for (Instruction &I : *BB)
+					{
+						auto [addr, width] = getCheckedAccess(&I);
+						if (!addr)
 						{
-							if (scevGepADD->getStart()->getExpressionSize() != 1)
-							{
-								continue;
-							}
-							// check invariant
-							Value *ptr = gep->getOperand(0);
-							if (!L->isLoopInvariant(ptr))
-							{
-								continue;
-							}
+							continue;
+						}
+						auto ptr = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(addr));
+						if (!ptr || ptr->getLoop() != L || !ptr->isAffine())
+						{
+							continue;
+						}
+						auto step = dyn_cast<SCEVConstant>(ptr->getStepRecurrence(SE));
+						if (!step || step->getAPInt().isZero())
+						{
+							continue;
+						}
+						RangeAccesses &range = ranges[{ptr, count}];
+						range.insts.push_back(&I);
+						range.width = std::max(range.width, width);
+					}
+				}
 
-							// gives us size
-							const SCEV *step = scevGepADD->getStepRecurrence(SE);
+				// Unconditional ranges first: they split the preheader and
+				// keep DT up to date, while versioning conditional accesses
+				// doesn't.
+				std::vector<std::pair<std::pair<const SCEVAddRecExpr *, const SCEV *>, RangeAccesses>> order(ranges.begin(), ranges.end());
+				std::stable_partition(order.begin(), order.end(), [](auto &range)
+									  { return range.first.second != nullptr; });
 
-							long long size;
-							if (auto ci = dyn_cast<SCEVConstant>(step))
-							{
-								size = ci->getValue()->getSExtValue();
-							}
-							else
-							{
-								continue;
-							}
+				VersionedBlocks conditionalBlocks;
+				SCEVExpander expander(SE, DL, "asan.range");
+				for (auto &[key, range] : order)
+				{
+					auto [ptr, count] = key;
+					// the count only bounds the iterations if the loop may
+					// end early
+					bool conditional = !count || mayExitEarly;
+					if (!count)
+					{
+						count = headerCount;
+					}
+
+					// [start, start + step * (count - 1) + width), or for a
+					// negative step
+					// [start + step * (count - 1), start + width)
+					const SCEV *start = ptr->getStart();
+					const SCEV *step = SE.getNoopOrSignExtend(ptr->getStepRecurrence(SE), i64);
+					const SCEV *last = SE.getMinusSCEV(count, SE.getOne(i64));
+					const SCEV *distance = SE.getMulExpr(step, last);
+					uint64_t stride = cast<SCEVConstant>(step)->getAPInt().abs().getZExtValue();
+					if (cast<SCEVConstant>(step)->getAPInt().isNegative())
+					{
+						start = SE.getAddExpr(start, distance);
+						distance = SE.getNegativeSCEV(distance);
+					}
+					const SCEV *size = SE.getAddExpr(distance, SE.getConstant(i64, range.width));
+
+					Loop *target = getHoistTarget(L, [&, count = count](Loop *P)
+												  { return SE.isLoopInvariant(start, P) && SE.isLoopInvariant(size, P) && SE.isLoopInvariant(count, P); });
+					Instruction *insertPt = target->getLoopPreheader()->getTerminator();
+					if (!isCheaperThan(insertPt->getParent(), range.insts))
+					{
+						rejectPlacement(range.insts.front(), getFrequency(insertPt->getParent()), getCheckCount(range.insts));
+						continue;
+					}
+					if (!isSafeToExpandAt(start, insertPt, SE) || !isSafeToExpandAt(size, insertPt, SE) || !isSafeToExpandAt(count, insertPt, SE))
+					{
+						ORE.emit([&]()
+								 { return OptimizationRemarkMissed(DEBUG_TYPE, "RangeNotExpandable", range.insts.front())
+										  << "range check not hoisted: its bounds can't be computed in the preheader"; });
+						continue;
+					}
+
+					Value *begin = expander.expandCodeFor(start, start->getType(), insertPt);
+					Value *sizeVal = expander.expandCodeFor(size, i64, insertPt);
+
+					if (conditional)
+					{
+						addVersionedAccesses(conditionalBlocks, L, range.insts, insertRegionQuery(insertPt, begin, sizeVal));
+						NumRangeVersioned += range.insts.size();
+						ORE.emit([&]()
+								 { return OptimizationRemark(DEBUG_TYPE, "RangeVersioned", range.insts.front())
+										  << "conditional checks of " << ore::NV("NumAccesses", (unsigned)range.insts.size())
+										  << " accesses skipped when the loop's whole range is addressable"; });
+						continue;
+					}
+
+					// zero-trip loops never touch the range
+					Value *guard = nullptr;
+					if (!SE.isKnownPositive(count))
+					{
+						Value *countVal = expander.expandCodeFor(count, i64, insertPt);
+						guard = new ICmpInst(insertPt, CmpInst::ICMP_NE, countVal, ConstantInt::get(i64, 0));
+					}
+
+					insertRegionCheck(insertPt, begin, sizeVal, range.width, stride, range.insts, guard);
+					for (Instruction *inst : range.insts)
+					{
+						inst->setMetadata(LLVMContext::MD_nosanitize, nosanitize);
+					}
+					NumRangeHoisted += range.insts.size();
+					ORE.emit([&]()
+							 { return OptimizationRemark(DEBUG_TYPE, "RangeHoisted", range.insts.front())
+									  << "checks of " << ore::NV("NumAccesses", (unsigned)range.insts.size())
+									  << " accesses hoisted out of the loop as one check of the range they cover"; });
+				}
+
+				versionBlocks(conditionalBlocks, L);
+			}
+		}
 
-							// sanitize instructions that use gep
-							no_sanitize_gep(gep, nosanitize);
+		void boundedIndexOptimization(Function &F)
+		{
+			/**
+			 * Bounded index optimization: an access like C[h % 1000] doesn't
+			 * walk memory in a pattern SCEV can follow, but its index only
+			 * takes values in a known range. If the base is loop-invariant,
+			 * the preheader asks once whether all of base + that range is
+			 * addressable, and while it is, the accesses run unchecked. The
+			 * index may never reach parts of the range (an srem can be
+			 * negative), so a poisoned range doesn't report; the accesses
+			 * just keep their own checks.
+			 */
 
-							Type *i64 = Type::getInt64Ty(context);
-							Value *offset = ConstantInt::get(i64, size * finalIVVal);
-							// call __asan_region_is_poison
-							std::vector<Value *> args = {ptr, offset};
-							Value *callRes = CallInst::Create(fty, arip, ArrayRef<Value *>(args), Twine(""), ppheader->getTerminator());
+			ScalarEvolution &SE = getAnalysis<ScalarEvolutionAnalysis>();
+			LoopInfo &LI = getAnalysis<LoopAnalysis>();
+			OptimizationRemarkEmitter &ORE = getAnalysis<OptimizationRemarkEmitterAnalysis>();
 
-							// create basic block
-							BasicBlock *checkBlock = BasicBlock::Create(context, Twine("__poison_check"), &F);
-							Type *ty = Type::getIntNTy(context, size * 8);
-							// insert load and branch instruction
-							new LoadInst(ty, callRes, Twine(""), checkBlock);
-							BranchInst::Create(preheader, checkBlock);
+			LLVMContext &context = F.getContext();
+			Type *i64 = Type::getInt64Ty(context);
 
-							// insert cmp and br instruction at preheader
-							Value *cpn = ConstantPointerNull::get(Type::getInt32PtrTy(context));
+			for (Loop *L : getLoopsInnermostFirst())
+			{
+				BasicBlock *preheader = L->getLoopPreheader();
+				if (!preheader || loopMayFree(L))
+				{
+					continue;
+				}
 
-							Value *cond = new ICmpInst(ppheader->getTerminator(), CmpInst::ICMP_EQ, callRes, cpn, Twine(""));
-							BranchInst::Create(preheader, checkBlock, cond, ppheader->getTerminator());
-							ppheader->getTerminator()->eraseFromParent();
+				// (base, first byte, end) -> accesses
+				MapVector<std::tuple<Value *, int64_t, int64_t>, std::vector<Instruction *>> spans;
+				for (BasicBlock *BB : L->blocks())
+				{
+					// accesses in inner loops are handled with their own loop
+					if (LI.getLoopFor(BB) != L)
+					{
+						continue;
+					}
+					for (Instruction &I : *BB)
+					{
+						auto [addr, width] = getCheckedAccess(&I);
+						if (!addr || L->isLoopInvariant(addr))
+						{
+							continue;
 						}
-						else
+						// walks are left to range hoisting and batching
+						auto walk = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(addr));
+						if (walk && walk->getLoop() == L)
+						{
+							continue;
+						}
+						Value *base;
+						Optional<ConstantRange> offset = getOffsetRange(addr, base);
+						if (!offset || !L->isLoopInvariant(base) || offset->isFullSet() || offset->isSignWrappedSet())
+						{
+							continue;
+						}
+						APInt begin = offset->getSignedMin().sext(128);
+						APInt end = offset->getSignedMax().sext(128) + width;
+						if ((end - begin).ugt(IndexSpan))
 						{
 							continue;
 						}
+						spans[{base, begin.getSExtValue(), end.getSExtValue()}].push_back(&I);
 					}
 				}
+
+				VersionedBlocks blocks;
+				for (auto &[key, insts] : spans)
+				{
+					auto [base, begin, end] = key;
+					Loop *target = getHoistTarget(L, [base = base](Loop *P)
+												  { return P->isLoopInvariant(base); });
+					Instruction *insertPt = target->getLoopPreheader()->getTerminator();
+					if (!isCheaperThan(insertPt->getParent(), insts))
+					{
+						rejectPlacement(insts.front(), getFrequency(insertPt->getParent()), getCheckCount(insts));
+						continue;
+					}
+
+					IRBuilder<> builder(insertPt);
+					Value *first = builder.CreateGEP(builder.getInt8Ty(), builder.CreatePointerCast(base, builder.getInt8PtrTy()), builder.getInt64(begin));
+					addVersionedAccesses(blocks, L, insts, insertRegionQuery(insertPt, first, ConstantInt::get(i64, end - begin)));
+					NumIndexVersioned += insts.size();
+					ORE.emit([&]()
+							 { return OptimizationRemark(DEBUG_TYPE, "IndexVersioned", insts.front())
+									  << "checks of " << ore::NV("NumAccesses", (unsigned)insts.size())
+									  << " accesses skipped when the " << ore::NV("Bytes", (uint64_t)(end - begin))
+									  << " bytes their index can reach are addressable"; });
+				}
+
+				versionBlocks(blocks, L);
 			}
+		}
 
-			// Possible better algorithm
-			// It would Use a lot of memory and maybe it is not worth it
-			// Forward BFS for BB, where ptr_group[BB][v] = union of ptr_group[P][v] for predecessors P of BB
-			// In BB, if new v has never been seen ptr_group[BB][v] = {id}
-			// Once at exit BB reverse map Int -> Value
-			// Add checks at each Int by finding common dominator of each Value
-			// std::unordered_map<BasicBlock*, std::unordered_map<Value*,std::unordered_set<int>>> ptr_group;
+		void batchedCheckOptimization(Function &F)
+		{
+			/**
+			 * Batched check optimization: an access that walks memory with
+			 * an affine address, but in a loop whose trip count SCEV can't
+			 * compute or with a stride that isn't a constant, can't get a
+			 * hoisted range check. With -optimize-asan-batch=N, the loop
+			 * instead asks once every N iterations whether the span the
+			 * next N iterations would touch is addressable, and while it
+			 * is, the accesses run unchecked. The loop may stop before the
+			 * end of that span, so a poisoned span doesn't report; the
+			 * accesses just take their own checks until the next query.
+			 * Each query also prefetches the shadow of the span after it.
+			 */
 
-			std::vector<std::vector<Instruction *>> mem_group;
-			std::unordered_map<Value *, int> ptr_group;
+			unsigned N = BatchIterations;
+			if (N < 2)
+			{
+				return;
+			}
 
-			for (BasicBlock &BB : F)
+			DominatorTree &DT = getAnalysis<DominatorTreeAnalysis>();
+			ScalarEvolution &SE = getAnalysis<ScalarEvolutionAnalysis>();
+			LoopInfo &LI = getAnalysis<LoopAnalysis>();
+			OptimizationRemarkEmitter &ORE = getAnalysis<OptimizationRemarkEmitterAnalysis>();
+			Module &M = *F.getParent();
+			const DataLayout &DL = M.getDataLayout();
+			LLVMContext &context = F.getContext();
+			Type *i64 = Type::getInt64Ty(context);
+			Type *i8Ptr = Type::getInt8PtrTy(context);
+
+			// the shadow of addr is at (addr >> scale) + shadowBase, unless
+			// the runtime picks the base at startup
+			uint64_t shadowBase = 0;
+			int shadowScale = 0;
+			bool orShadowBase = false;
+			getAddressSanitizerParams(Triple(M.getTargetTriple()), DL.getPointerSizeInBits(), false, &shadowBase, &shadowScale, &orShadowBase);
+			bool prefetch = shadowBase != ~0ULL;
+
+			for (Loop *L : getLoopsInnermostFirst())
 			{
-				for (Instruction &I : BB)
+				BasicBlock *preheader = L->getLoopPreheader();
+				BasicBlock *header = L->getHeader();
+				if (!L->isInnermost() || !preheader || !L->getLoopLatch() || header->isEHPad() || loopMayFree(L))
+				{
+					continue;
+				}
+				bool countKnown = !isa<SCEVCouldNotCompute>(SE.getBackedgeTakenCount(L));
+
+				// address -> accesses. span is step * (N - 1) for a constant
+				// step.
+				struct Walk
 				{
-					bool b1 = I.getOpcode() == Instruction::Load && !I.hasMetadata("nosanitize");
-					bool b2 = I.getOpcode() == Instruction::Store && !I.hasMetadata("nosanitize");
-					if (b1 || b2)
+					std::vector<Instruction *> insts;
+					unsigned width = 0;
+					std::optional<APInt> span;
+				};
+				MapVector<const SCEVAddRecExpr *, Walk> walks;
+				std::vector<Instruction *> insts;
+				Instruction *splitPt = &*header->getFirstInsertionPt();
+				for (BasicBlock *BB : L->blocks())
+				{
+					for (Instruction &I : *BB)
 					{
-						Value *addr;
-						if (b1)
+						auto [addr, width] = getCheckedAccess(&I);
+						if (!addr)
 						{
-							addr = I.getOperand(0);
+							continue;
 						}
-						else
+						auto ptr = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(addr));
+						if (!ptr || ptr->getLoop() != L || !ptr->isAffine() || ptr->getStepRecurrence(SE)->isZero())
 						{
-							addr = I.getOperand(1);
+							continue;
 						}
-						if (ptr_group.find(addr) == ptr_group.end())
+						// range hoisting covers the rest
+						if (countKnown && isa<SCEVConstant>(ptr->getStepRecurrence(SE)))
 						{
-							ptr_group[addr] = mem_group.size();
-							std::vector<Instruction *> v;
-							mem_group.push_back(v);
+							continue;
 						}
-						if (ptr_group[addr] != -1)
+						if (!isSafeToExpandAt(ptr, splitPt, SE) || !isSafeToExpandAt(ptr->getStepRecurrence(SE), preheader->getTerminator(), SE))
 						{
-							mem_group[ptr_group[addr]].push_back(&I);
+							continue;
 						}
-					}
-					else if (auto callInst = dyn_cast<CallInst>(&I))
-					{
-						// callInst->print(errs());
-						// errs() << "\n";
-						for (auto &v : callInst->args())
+						std::optional<APInt> span;
+						if (auto step = dyn_cast<SCEVConstant>(ptr->getStepRecurrence(SE)))
 						{
-							// v->print(errs());
-							if (ptr_group.find(v) != ptr_group.end() && ptr_group[v] != -1)
+							bool overflow = false;
+							span = step->getAPInt().abs().umul_ov(APInt(step->getAPInt().getBitWidth(), N - 1), overflow);
+							if (overflow || span->getActiveBits() > 64)
 							{
-								ptr_group[v] = -1;
-								// eliminate_mem(ptr_group, ptr_group[v]);
+								continue;
 							}
-							// errs() << ", ";
 						}
-						// errs() << "\n";
+						Walk &walk = walks[ptr];
+						walk.insts.push_back(&I);
+						walk.width = std::max(walk.width, width);
+						walk.span = span;
+						insts.push_back(&I);
+					}
+				}
+				if (walks.empty())
+				{
+					continue;
+				}
+
+				// a query per walk per batch, and at least one per entry
+				uint64_t batched = SaturatingMultiply<uint64_t>(walks.size(), SaturatingAdd(getFrequency(header) / N, getFrequency(preheader)));
+				if (batched >= getCheckCount(insts))
+				{
+					rejectPlacement(insts.front(), batched, getCheckCount(insts));
+					continue;
+				}
+
+				// header:
+				//   left = phi [0, preheader], [left.next, latch]
+				//   clean = phi [false, preheader], [clean.cur, latch]
+				//   br (left == 0), asan.batch, rest
+				// asan.batch:
+				//   query the next N iterations' span of every walk
+				// rest:
+				//   left.cur, clean.cur = N, all spans clean or left, clean
+				//   left.next = left.cur - 1
+				PHINode *left = PHINode::Create(i64, 2, "asan.left", &header->front());
+				PHINode *clean = PHINode::Create(Type::getInt1Ty(context), 2, "asan.clean", &header->front());
+				IRBuilder<> builder(splitPt);
+				Value *refill = builder.CreateICmpEQ(left, ConstantInt::get(i64, 0));
+				MDNode *weights = MDBuilder(context).createBranchWeights(1, N - 1);
+				Instruction *batchTerm = SplitBlockAndInsertIfThen(refill, splitPt, false, weights, &DT, &LI);
+				BasicBlock *batch = batchTerm->getParent();
+				batch->setName("asan.batch");
+				BasicBlock *rest = splitPt->getParent();
+
+				builder.SetInsertPoint(&rest->front());
+				PHINode *leftCur = builder.CreatePHI(i64, 2, "asan.left.cur");
+				leftCur->addIncoming(ConstantInt::get(i64, N), batch);
+				leftCur->addIncoming(left, header);
+				PHINode *cleanCur = builder.CreatePHI(Type::getInt1Ty(context), 2, "asan.clean.cur");
+				cleanCur->addIncoming(clean, header);
+				builder.SetInsertPoint(rest->getFirstNonPHI());
+				Value *leftNext = builder.CreateSub(leftCur, ConstantInt::get(i64, 1), "asan.left.next");
+
+				BasicBlock *latch = L->getLoopLatch();
+				left->addIncoming(ConstantInt::get(i64, 0), preheader);
+				left->addIncoming(leftNext, latch);
+				clean->addIncoming(builder.getFalse(), preheader);
+				clean->addIncoming(cleanCur, latch);
+
+				SCEVExpander expander(SE, DL, "asan.batch");
+				builder.SetInsertPoint(batchTerm);
+				Value *allClean = nullptr;
+				for (auto &[ptr, walk] : walks)
+				{
+					// [p, p + step * (N - 1) + width), or for a negative step
+					// [p + step * (N - 1), p + width). A stride only known at
+					// run time may overflow the span, which counts as not
+					// clean.
+					const SCEV *stepSCEV = SE.getNoopOrSignExtend(ptr->getStepRecurrence(SE), i64);
+					Value *step = expander.expandCodeFor(stepSCEV, i64, preheader->getTerminator());
+					Value *p = builder.CreatePtrToInt(expander.expandCodeFor(ptr, ptr->getType(), batchTerm), i64);
+					Value *begin;
+					Value *span;
+					Value *overflow = nullptr;
+					if (auto constant = dyn_cast<SCEVConstant>(stepSCEV))
+					{
+						span = ConstantInt::get(i64, walk.span->zextOrTrunc(64));
+						begin = constant->getAPInt().isNegative() ? builder.CreateSub(p, span) : p;
+					}
+					else
+					{
+						Value *negative = builder.CreateICmpSLT(step, ConstantInt::get(i64, 0));
+						Value *stride = builder.CreateSelect(negative, builder.CreateNeg(step), step);
+						Value *spanOverflow = builder.CreateBinaryIntrinsic(Intrinsic::umul_with_overflow, stride, ConstantInt::get(i64, N - 1));
+						span = builder.CreateExtractValue(spanOverflow, 0);
+						overflow = builder.CreateExtractValue(spanOverflow, 1);
+						begin = builder.CreateSelect(negative, builder.CreateSub(p, span), p);
+					}
+					Value *size = builder.CreateAdd(span, ConstantInt::get(i64, walk.width));
+					Value *safe = insertRegionQuery(batchTerm, builder.CreateIntToPtr(begin, i8Ptr), size);
+					if (overflow)
+					{
+						safe = builder.CreateAnd(safe, builder.CreateNot(overflow));
 					}
+					allClean = allClean ? builder.CreateAnd(allClean, safe) : safe;
+
+					if (prefetch)
+					{
+						Value *next = builder.CreateAdd(p, builder.CreateMul(step, ConstantInt::get(i64, N)));
+						Value *shadow = builder.CreateLShr(next, shadowScale);
+						shadow = orShadowBase ? builder.CreateOr(shadow, shadowBase) : builder.CreateAdd(shadow, ConstantInt::get(i64, shadowBase));
+						// read, high locality, data cache
+						builder.CreateIntrinsic(Intrinsic::prefetch, {i8Ptr},
+												{builder.CreateIntToPtr(shadow, i8Ptr), builder.getInt32(0), builder.getInt32(3), builder.getInt32(1)});
+					}
+				}
+				cleanCur->addIncoming(allClean, batch);
+
+				// block -> its accesses, in order
+				MapVector<BasicBlock *, std::vector<Instruction *>> blocks;
+				for (Instruction *inst : insts)
+				{
+					blocks[inst->getParent()].push_back(inst);
+				}
+				for (auto &[BB, blockInsts] : blocks)
+				{
+					std::sort(blockInsts.begin(), blockInsts.end(), [](Instruction *a, Instruction *b)
+							  { return a->comesBefore(b); });
+					versionAccesses(blockInsts, cleanCur);
 				}
+				DT.recalculate(F);
+				SE.forgetLoop(L);
+
+				NumBatched += insts.size();
+				ORE.emit([&]()
+						 { return OptimizationRemark(DEBUG_TYPE, "Batched", insts.front())
+								  << "checks of " << ore::NV("NumAccesses", (unsigned)insts.size())
+								  << " accesses done once every " << ore::NV("Iterations", N)
+								  << " iterations for the iterations to come"; });
 			}
-			errs() << "Size of mem_group=" << mem_group.size() << "\n";
-			for (unsigned i = 0; i < mem_group.size(); ++i)
+		}
+
+		void frequentPathOptimization(Function &F)
+		{
+			/**
+			 * Loop optimization: This optimization will move ASan
+			 * instrumentation code off of the frequent path and onto the
+			 * infrequent path for basic loops.
+			 *
+			 * If an access on the frequent path (the trace) gets its address
+			 * from values that only the infrequent path changes, the address
+			 * is the same as last iteration for as long as we stay on the
+			 * trace. We clone the loop into a checked copy and an unchecked
+			 * hot copy. The checked copy runs the first iteration, which
+			 * peels the first access, and every iteration after the
+			 * infrequent path is taken. Once it has run a whole iteration
+			 * along the trace, control goes back to the hot copy.
+			 */
+
+			DominatorTree &DT = getAnalysis<DominatorTreeAnalysis>();
+			ScalarEvolution &SE = getAnalysis<ScalarEvolutionAnalysis>();
+			LoopInfo &LI = getAnalysis<LoopAnalysis>();
+			OptimizationRemarkEmitter &ORE = getAnalysis<OptimizationRemarkEmitterAnalysis>();
+			// The cached ones predate the blocks that versioning split off,
+			// and getFrequency() gives a versioned slow path the frequency
+			// of the block it was split from, so cost the traces with
+			// fresh ones.
+			PostDominatorTree PDT(F);
+			BranchProbabilityInfo BPI(F, LI, &getAnalysis<TargetLibraryAnalysis>(), &DT, &PDT);
+			BlockFrequencyInfo BFI(F, BPI, LI);
+			auto frequency = [&](BasicBlock *BB)
+			{ return BFI.getBlockFreq(BB).getFrequency(); };
+
+			LLVMContext &context = F.getContext();
+			MDNode *nosanitize = MDNode::get(context, MDString::get(context, "nosanitize"));
+
+			// LoopInfo is rebuilt after each loop we clone, so go by header
+			std::vector<BasicBlock *> headers;
+			for (Loop *L : getLoopsInnermostFirst())
 			{
-				errs() << "Size of val=" << mem_group[i].size() << "\n";
-				auto it = mem_group[i].begin();
-				while (it != mem_group[i].end())
+				if (L->isInnermost())
 				{
-					(*it)->print(errs());
-					errs() << "\n";
-					++it;
+					headers.push_back(L->getHeader());
 				}
 			}
 
-			for (auto &list : mem_group)
+			for (BasicBlock *header : headers)
 			{
-				if (list.size() == 1)
+				Loop *L = LI.getLoopFor(header);
+				BasicBlock *preheader = L->getLoopPreheader();
+				if (!preheader || loopMayFree(L))
 				{
 					continue;
 				}
-
-				Instruction *cdom = list.front();
-				for (auto &inst : list)
+				// edges are moved between the copies by rewriting branches
+				if (!all_of(L->blocks(), [](BasicBlock *BB)
+							{ return isa<BranchInst>(BB->getTerminator()) && !BB->isEHPad(); }))
 				{
-					cdom = findNearestCommonDominator(DT, inst, cdom);
+					continue;
 				}
 
-				unsigned max_width = 0;
-				for (auto &inst : list)
+				// populate trace by following frequent path; give up if it
+				// leaves the loop or revisits a block instead of coming back
+				// to the header
+				Trace trace;
 				{
-					unsigned width = get_width(inst);
-					if (max_width < width)
+					BasicBlock *curr = header;
+					do
 					{
-						max_width = width;
+						trace.index[curr] = trace.blocks.size();
+						trace.blocks.push_back(curr);
+						curr = getLikelySuccessor(BPI, curr);
+					} while (curr && curr != header && L->contains(curr) && !trace.contains(curr));
+					if (curr != header || trace.blocks.back()->getTerminator()->getNumSuccessors() != 2)
+					{
+						continue;
 					}
-					errs() << "Setting NOSANITIZE\n";
-					inst->setMetadata(LLVMContext::MD_nosanitize, nosanitize);
 				}
-				if (max_width != 0)
+
+				// find memory instructions in trace whose addresses only
+				// change on the infrequent path
+				std::unordered_map<Value *, bool> memo;
+				std::vector<Instruction *> hotAccesses;
+				for (BasicBlock *BB : trace.blocks)
 				{
-					LLVMContext &context = cdom->getContext();
-					Type *ty = Type::getIntNTy(context, max_width);
-					Value *ptr;
-					if (list.front()->getOpcode() == Instruction::Load)
+					for (Instruction &I : *BB)
 					{
-						ptr = list.front()->getOperand(0);
-					}
-					else
-					{
-						ptr = list.front()->getOperand(1);
+						Value *ptr = getCheckedAccess(&I).first;
+						if (ptr && !L->isLoopInvariant(ptr) && isTraceInvariant(ptr, L, trace, memo))
+						{
+							hotAccesses.push_back(&I);
+						}
 					}
-					new LoadInst(ty, ptr, Twine(""), cdom);
 				}
-			}
-
-			frequentPathOptimization(F);
+				if (hotAccesses.empty())
+				{
+					continue;
+				}
+
+				// Each time the loop is entered or the infrequent path comes
+				// back to the trace, the checked copy runs the rest of that
+				// iteration and one more. Only clone if that executes fewer
+				// checks than checking the hot accesses every time.
+				uint64_t entries = frequency(preheader);
+				for (BasicBlock *BB : L->blocks())
+				{
+					for (BasicBlock *succ : successors(BB))
+					{
+						if (trace.contains(succ) && !trace.isEdge(BB, succ))
+						{
+							uint64_t edgeFreq = BPI.getEdgeProbability(BB, succ).scale(frequency(BB));
+							entries = SaturatingAdd(entries, SaturatingMultiply(edgeFreq, (uint64_t)2));
+						}
+					}
+				}
+				uint64_t checkedCopyChecks = SaturatingMultiply(entries, (uint64_t)hotAccesses.size());
+				uint64_t hotChecks = 0;
+				for (Instruction *inst : hotAccesses)
+				{
+					hotChecks = SaturatingAdd(hotChecks, frequency(inst->getParent()));
+				}
+				if (checkedCopyChecks >= hotChecks)
+				{
+					rejectPlacement(hotAccesses.front(), checkedCopyChecks, hotChecks);
+					continue;
+				}
+
+				SE.forgetLoop(L);
+				std::vector<BasicBlock *> blocks = L->getBlocks();
+				ValueToValueMapTy vmap;
+				for (BasicBlock *BB : blocks)
+				{
+					vmap[BB] = CloneBasicBlock(BB, vmap, ".asan.checked", &F);
+				}
+				auto checked = [&](BasicBlock *BB)
+				{ return cast<BasicBlock>(vmap[BB]); };
+				for (BasicBlock *BB : blocks)
+				{
+					for (Instruction &I : *checked(BB))
+					{
+						RemapInstruction(&I, vmap, RF_IgnoreMissingLocals | RF_NoModuleLevelChanges);
+					}
+					// exits are now reached from both copies
+					for (BasicBlock *succ : successors(BB))
+					{
+						if (!L->contains(succ))
+						{
+							for (PHINode &phi : succ->phis())
+							{
+								phi.addIncoming(phi.getIncomingValueForBlock(BB), checked(BB));
+							}
+						}
+					}
+				}
+
+				// The loop is entered in the checked copy, and the hot copy
+				// leaves the trace for the checked copy as soon as the
+				// infrequent path comes back to it.
+				for (PHINode &phi : checked(header)->phis())
+				{
+					phi.removeIncomingValue(preheader, false);
+				}
+				redirectEdges(preheader, header, checked(header));
+				for (BasicBlock *BB : blocks)
+				{
+					std::vector<BasicBlock *> sideExits;
+					for (BasicBlock *succ : successors(BB))
+					{
+						if (trace.contains(succ) && !trace.isEdge(BB, succ))
+						{
+							sideExits.push_back(succ);
+						}
+					}
+					for (BasicBlock *succ : sideExits)
+					{
+						redirectEdges(BB, succ, checked(succ));
+					}
+				}
+
+				// clean: this iteration of the checked copy has stayed on the
+				// trace since the header, so it has checked every hot access
+				Value *clean = ConstantInt::getTrue(context);
+				for (unsigned i = 1; i < trace.blocks.size(); ++i)
+				{
+					BasicBlock *BB = checked(trace.blocks[i]);
+					BasicBlock *tracePred = checked(trace.blocks[i - 1]);
+					if (BB->getSinglePredecessor() == tracePred)
+					{
+						continue;
+					}
+					PHINode *phi = PHINode::Create(Type::getInt1Ty(context), 2, "asan.clean", &BB->front());
+					for (BasicBlock *pred : predecessors(BB))
+					{
+						phi->addIncoming(pred == tracePred ? clean : ConstantInt::getFalse(context), pred);
+					}
+					clean = phi;
+				}
+
+				// after a clean iteration, continue in the hot copy
+				BasicBlock *checkedHeader = checked(header);
+				BasicBlock *checkedLatch = checked(trace.blocks.back());
+				BasicBlock *hotEntry = BasicBlock::Create(context, "asan.hot", &F, header);
+				BranchInst::Create(header, hotEntry);
+				for (auto [hotPhi, checkedPhi] : zip(header->phis(), checkedHeader->phis()))
+				{
+					hotPhi.addIncoming(checkedPhi.getIncomingValueForBlock(checkedLatch), hotEntry);
+				}
+				if (isa<Constant>(clean))
+				{
+					for (PHINode &phi : checkedHeader->phis())
+					{
+						phi.removeIncomingValue(checkedLatch, false);
+					}
+					checkedLatch->getTerminator()->replaceSuccessorWith(checkedHeader, hotEntry);
+				}
+				else
+				{
+					BasicBlock *backedge = BasicBlock::Create(context, "asan.backedge", &F, header);
+					BranchInst::Create(hotEntry, checkedHeader, clean, backedge);
+					for (PHINode &phi : checkedHeader->phis())
+					{
+						phi.replaceIncomingBlockWith(checkedLatch, backedge);
+					}
+					checkedLatch->getTerminator()->replaceSuccessorWith(checkedHeader, backedge);
+				}
+
+				// Control now crosses between the copies in the middle of an
+				// iteration, so a use may be reached by either copy of its
+				// definition.
+				for (BasicBlock *BB : blocks)
+				{
+					for (Instruction &I : *BB)
+					{
+						if (I.getType()->isVoidTy())
+						{
+							continue;
+						}
+						Instruction *clone = cast<Instruction>(vmap[&I]);
+						std::vector<Use *> uses;
+						for (Instruction *def : {&I, clone})
+						{
+							for (Use &U : def->uses())
+							{
+								Instruction *user = cast<Instruction>(U.getUser());
+								if (isa<PHINode>(user) || user->getParent() != def->getParent())
+								{
+									uses.push_back(&U);
+								}
+							}
+						}
+						SSAUpdater ssa;
+						ssa.Initialize(I.getType(), I.getName());
+						ssa.AddAvailableValue(BB, &I);
+						ssa.AddAvailableValue(clone->getParent(), clone);
+						for (Use *U : uses)
+						{
+							ssa.RewriteUse(*U);
+						}
+					}
+				}
+
+				for (Instruction *inst : hotAccesses)
+				{
+					inst->setMetadata(LLVMContext::MD_nosanitize, nosanitize);
+				}
+				NumFrequentPath += hotAccesses.size();
+				ORE.emit([&]()
+						 { return OptimizationRemark(DEBUG_TYPE, "FrequentPath", hotAccesses.front())
+								  << "checks of " << ore::NV("NumAccesses", (unsigned)hotAccesses.size())
+								  << " accesses moved off the frequent path of the loop"; });
+
+				DT.recalculate(F);
+				LI.releaseMemory();
+				LI.analyze(DT);
+			}
+		}
+
+		void invariantAddressOptimization(Function &F)
+		{
+			/**
+			 * Invariant address optimization: If a memory instruction is
+			 * issued to an invariant address w.r.t. the loop, we hoist the
+			 * check into the preheader.
+			 *
+			 * This is useful because classical optimizations can't hoist
+			 * things like stores, and we also don't want to check shadow mem
+			 * each time.
+			 *
+			 * An access that doesn't run on every iteration gets a reporting
+			 * check only if its execution count is known and nothing can
+			 * leave the loop early. Otherwise the preheader just asks
+			 * whether the address is addressable, and the access branches to
+			 * an unchecked copy when it is.
+			 */
+
+			DominatorTree &DT = getAnalysis<DominatorTreeAnalysis>();
+			ScalarEvolution &SE = getAnalysis<ScalarEvolutionAnalysis>();
+			LoopInfo &LI = getAnalysis<LoopAnalysis>();
+			OptimizationRemarkEmitter &ORE = getAnalysis<OptimizationRemarkEmitterAnalysis>();
+			const DataLayout &DL = F.getParent()->getDataLayout();
+
+			LLVMContext &context = F.getContext();
+			MDNode *nosanitize = MDNode::get(context, MDString::get(context, "nosanitize"));
+
+			for (Loop *L : getLoopsInnermostFirst())
+			{
+				// hoisting is only sound if the memory can't go away between
+				// iterations
+				BasicBlock *preheader = L->getLoopPreheader();
+				if (!preheader || loopMayFree(L))
+				{
+					continue;
+				}
+
+				SimpleLoopSafetyInfo safetyInfo;
+				safetyInfo.computeLoopSafetyInfo(L);
+
+				// one check per (address, execution count); a null count means
+				// the access runs whenever the loop is entered
+				MapVector<std::pair<Value *, const SCEV *>, std::vector<Instruction *>> checks;
+				// address -> accesses that are versioned on a query instead
+				MapVector<Value *, std::vector<Instruction *>> queries;
+				for (BasicBlock *BB : L->blocks())
+				{
+					for (Instruction &I : *BB)
+					{
+						if (!isa<LoadInst>(I) && !isa<StoreInst>(I))
+						{
+							continue;
+						}
+						if (I.hasMetadata(LLVMContext::MD_nosanitize))
+						{
+							continue;
+						}
+						Value *ptr = getLoadStorePointerOperand(&I);
+						if (!L->isLoopInvariant(ptr))
+						{
+							continue;
+						}
+
+						const SCEV *count = nullptr;
+						if (!safetyInfo.isGuaranteedToExecute(I, &DT, L))
+						{
+							// the count only bounds how often I runs if the
+							// loop may end early
+							count = safetyInfo.anyBlockMayThrow() ? nullptr : getExecutionCount(L, BB);
+							if (!count)
+							{
+								// accesses in inner loops are handled with
+								// their own loop
+								if (LI.getLoopFor(BB) == L)
+								{
+									queries[ptr].push_back(&I);
+								}
+								continue;
+							}
+						}
+
+						checks[{ptr, count}].push_back(&I);
+					}
+				}
+
+				SCEVExpander expander(SE, DL, "asan.invar");
+				for (auto &[key, insts] : checks)
+				{
+					auto [ptr, count] = key;
+					unsigned width = 0;
+					for (Instruction *inst : insts)
+					{
+						width = std::max(width, (unsigned)DL.getTypeStoreSize(getLoadStoreType(inst)));
+					}
+					Loop *target = getHoistTarget(L, [&, ptr = ptr, count = count](Loop *P)
+												  { return P->isLoopInvariant(ptr) && (!count || SE.isLoopInvariant(count, P)); });
+					Instruction *insertPt = target->getLoopPreheader()->getTerminator();
+					if (!isCheaperThan(insertPt->getParent(), insts))
+					{
+						rejectPlacement(insts.front(), getFrequency(insertPt->getParent()), getCheckCount(insts));
+						continue;
+					}
+					for (Instruction *inst : insts)
+					{
+						inst->setMetadata(LLVMContext::MD_nosanitize, nosanitize);
+					}
+					NumInvariantHoisted += insts.size();
+					ORE.emit([&]()
+							 { return OptimizationRemark(DEBUG_TYPE, "InvariantHoisted", insts.front())
+									  << "check of loop-invariant address hoisted out of "
+									  << ore::NV("NumLoops", L->getLoopDepth() - target->getLoopDepth() + 1) << " loops"; });
+
+					Value *guard = nullptr;
+					if (count && !SE.isKnownPositive(count))
+					{
+						Value *countVal = expander.expandCodeFor(count, count->getType(), insertPt);
+						guard = new ICmpInst(insertPt, CmpInst::ICMP_NE, countVal, ConstantInt::get(count->getType(), 0));
+					}
+					insertRegionCheck(insertPt, ptr, ConstantInt::get(Type::getInt64Ty(context), width), width, width, insts, guard);
+				}
+
+				VersionedBlocks blocks;
+				for (auto &[ptr, insts] : queries)
+				{
+					unsigned width = 0;
+					for (Instruction *inst : insts)
+					{
+						width = std::max(width, (unsigned)DL.getTypeStoreSize(getLoadStoreType(inst)));
+					}
+					Loop *target = getHoistTarget(L, [ptr = ptr](Loop *P)
+												  { return P->isLoopInvariant(ptr); });
+					Instruction *insertPt = target->getLoopPreheader()->getTerminator();
+					if (!isCheaperThan(insertPt->getParent(), insts))
+					{
+						rejectPlacement(insts.front(), getFrequency(insertPt->getParent()), getCheckCount(insts));
+						continue;
+					}
+
+					addVersionedAccesses(blocks, L, insts, insertRegionQuery(insertPt, ptr, ConstantInt::get(Type::getInt64Ty(context), width)));
+					NumInvariantVersioned += insts.size();
+					ORE.emit([&]()
+							 { return OptimizationRemark(DEBUG_TYPE, "InvariantVersioned", insts.front())
+									  << "conditional check of loop-invariant address skipped when a hoisted query finds it addressable"; });
+				}
+
+				versionBlocks(blocks, L);
+			}
+		}
+
+		// The set of checks that have already happened at some point:
+		// address -> number of bytes validated. Addresses are keyed by
+		// their SCEV, so GEPs that compute the same address separately
+		// share one check.
+		using CheckSet = std::unordered_map<const SCEV *, unsigned>;
+
+		// an address with each SCEV in a CheckSet, for alias queries
+		std::unordered_map<const SCEV *, Value *> checkedAddrs;
+
+		// Returns the address and width (in bytes) of an access that ASan
+		// will check, or {nullptr, 0} if inst isn't one.
+		std::pair<Value *, unsigned> getCheckedAccess(Instruction *inst)
+		{
+			if (!isa<LoadInst>(inst) && !isa<StoreInst>(inst))
+			{
+				return {nullptr, 0};
+			}
+			if (inst->hasMetadata(LLVMContext::MD_nosanitize))
+			{
+				return {nullptr, 0};
+			}
+			const DataLayout &DL = inst->getModule()->getDataLayout();
+			return {getLoadStorePointerOperand(inst), DL.getTypeStoreSize(getLoadStoreType(inst))};
+		}
+
+		// Applies inst to checks. Returns true if inst is an access whose
+		// check has already happened.
+		bool transferCheck(Instruction *inst, CheckSet &checks)
+		{
+			if (mayFreeMemory(inst))
+			{
+				for (auto it = checks.begin(); it != checks.end();)
+				{
+					it = mayFreeMemory(inst, checkedAddrs.at(it->first)) ? checks.erase(it) : std::next(it);
+				}
+				return false;
+			}
+			auto [ptr, width] = getCheckedAccess(inst);
+			if (!ptr)
+			{
+				return false;
+			}
+			const SCEV *addr = getAnalysis<ScalarEvolutionAnalysis>().getSCEV(ptr);
+			checkedAddrs.emplace(addr, ptr);
+			unsigned &available = checks[addr];
+			if (available >= width)
+			{
+				return true;
+			}
+			available = width;
+			return false;
+		}
+
+		// Returns true if some path from `from` to `to` passes an
+		// instruction (other than the two) that matches. `from` must
+		// dominate `to`.
+		bool anyBetween(Instruction *from, Instruction *to, function_ref<bool(Instruction *)> matches)
+		{
+			std::unordered_set<BasicBlock *> visited;
+			// (block, position to scan backwards from)
+			std::vector<std::pair<BasicBlock *, BasicBlock::iterator>> stack;
+			stack.push_back({to->getParent(), to->getIterator()});
+			while (!stack.empty())
+			{
+				auto [BB, it] = stack.back();
+				stack.pop_back();
+
+				bool reachedFrom = false;
+				while (it != BB->begin())
+				{
+					--it;
+					if (&*it == from)
+					{
+						reachedFrom = true;
+						break;
+					}
+					if (matches(&*it))
+					{
+						return true;
+					}
+				}
+				if (reachedFrom)
+				{
+					continue;
+				}
+
+				for (BasicBlock *pred : predecessors(BB))
+				{
+					if (visited.insert(pred).second)
+					{
+						stack.push_back({pred, pred->end()});
+					}
+				}
+			}
+			return false;
+		}
+
+		// Returns true if some path from `from` to `to` passes an
+		// instruction that may free the memory ptr points into. `from` must
+		// dominate `to`.
+		bool mayFreeBetween(Instruction *from, Instruction *to, Value *ptr)
+		{
+			return anyBetween(from, to, [&](Instruction *inst)
+							  { return mayFreeMemory(inst, ptr); });
+		}
+
+		// Returns true if every time execution reaches `at`, it goes on to
+		// reach inst: inst post-dominates `at`, and nothing in between may
+		// throw, exit or not return. A check of inst's memory at `at` then
+		// never runs on a path that wouldn't have checked it anyway. `at`
+		// must dominate inst.
+		bool isAnticipated(PostDominatorTree &PDT, Instruction *at, Instruction *inst)
+		{
+			if (at == inst)
+			{
+				return true;
+			}
+			if (at->getParent() != inst->getParent() && !PDT.dominates(inst->getParent(), at->getParent()))
+			{
+				return false;
+			}
+			return !anyBetween(at, inst, [](Instruction *between)
+							   { return !isGuaranteedToTransferExecutionToSuccessor(between); });
+		}
+
+		void availableCheckElimination(Function &F)
+		{
+			/**
+			 * Available check elimination: a forward dataflow over the CFG
+			 * tracks which (address, width) checks have happened on every
+			 * path to each point. An access whose check is already available
+			 * doesn't need its own. A check is killed only by instructions
+			 * that may free or re-poison the memory it covers.
+			 */
+
+			OptimizationRemarkEmitter &ORE = getAnalysis<OptimizationRemarkEmitterAnalysis>();
+			checkedAddrs.clear();
+
+			LLVMContext &context = F.getContext();
+			MDNode *nosanitize = MDNode::get(context, MDString::get(context, "nosanitize"));
+
+			ReversePostOrderTraversal<Function *> RPOT(&F);
+
+			// no entry means the block hasn't been visited yet, i.e. every
+			// check is available there
+			std::unordered_map<BasicBlock *, CheckSet> out;
+			auto getIn = [&](BasicBlock *BB)
+			{
+				CheckSet in;
+				bool first = true;
+				for (BasicBlock *pred : predecessors(BB))
+				{
+					auto predOut = out.find(pred);
+					if (predOut == out.end())
+					{
+						continue;
+					}
+					if (first)
+					{
+						in = predOut->second;
+						first = false;
+						continue;
+					}
+					for (auto it = in.begin(); it != in.end();)
+					{
+						auto other = predOut->second.find(it->first);
+						if (other == predOut->second.end())
+						{
+							it = in.erase(it);
+						}
+						else
+						{
+							it->second = std::min(it->second, other->second);
+							++it;
+						}
+					}
+				}
+				return in;
+			};
+
+			bool changed = true;
+			while (changed)
+			{
+				changed = false;
+				for (BasicBlock *BB : RPOT)
+				{
+					CheckSet checks = getIn(BB);
+					for (Instruction &I : *BB)
+					{
+						transferCheck(&I, checks);
+					}
+					auto it = out.find(BB);
+					if (it == out.end() || it->second != checks)
+					{
+						out[BB] = std::move(checks);
+						changed = true;
+					}
+				}
+			}
+
+			std::vector<Instruction *> redundant;
+			for (BasicBlock *BB : RPOT)
+			{
+				CheckSet checks = getIn(BB);
+				for (Instruction &I : *BB)
+				{
+					if (transferCheck(&I, checks))
+					{
+						redundant.push_back(&I);
+					}
+				}
+			}
+			for (Instruction *inst : redundant)
+			{
+				inst->setMetadata(LLVMContext::MD_nosanitize, nosanitize);
+				++NumRedundant;
+				ORE.emit([&]()
+						 { return OptimizationRemark(DEBUG_TYPE, "Redundant", inst)
+								  << "check removed: address already checked on every path here"; });
+			}
+		}
+
+		void groupCheckOptimization(Function &F)
+		{
+			/**
+			 * Group check optimization: accesses off the same base at
+			 * constant offsets from each other (p[i], p[i+1], s->a, s->b)
+			 * share one check at their nearest common dominator, as long as
+			 * together they span at most -optimize-asan-group-window bytes.
+			 * A group only grows while no path from that dominator to any of
+			 * its accesses may free memory.
+			 *
+			 * The dominator also has to anticipate every access in the
+			 * group: all paths from it reach them. Accesses on different
+			 * arms of a branch stay apart, since a merged check above the
+			 * branch would check memory on paths that never touch it and
+			 * could report a bug that doesn't happen.
+			 */
+
+			DominatorTree &DT = getAnalysis<DominatorTreeAnalysis>();
+			// the CFG has changed since any cached one was computed
+			PostDominatorTree PDT(F);
+			ScalarEvolution &SE = getAnalysis<ScalarEvolutionAnalysis>();
+			OptimizationRemarkEmitter &ORE = getAnalysis<OptimizationRemarkEmitterAnalysis>();
+			const DataLayout &DL = F.getParent()->getDataLayout();
+
+			LLVMContext &context = F.getContext();
+			MDNode *nosanitize = MDNode::get(context, MDString::get(context, "nosanitize"));
+
+			// Each group covers [anchor + begin, anchor + end), where anchor
+			// is the address of its first access.
+			struct MemGroup
+			{
+				std::vector<Instruction *> insts;
+				Instruction *dom;
+				const SCEV *anchor;
+				int64_t begin, end;
+			};
+			std::vector<MemGroup> mem_group;
+			std::unordered_map<const SCEV *, std::vector<int>> ptr_group;
+
+			ReversePostOrderTraversal<Function *> RPOT(&F);
+			for (BasicBlock *BB : RPOT)
+			{
+				for (Instruction &I : *BB)
+				{
+					auto [addr, width] = getCheckedAccess(&I);
+					if (!addr)
+					{
+						continue;
+					}
+					const SCEV *ptr = SE.getSCEV(addr);
+					const SCEV *base = SE.getPointerBase(ptr);
+
+					bool grouped = false;
+					// expected checks of the last merge the cost model rejected
+					Optional<std::pair<uint64_t, uint64_t>> tooCostly;
+					for (int g : ptr_group[base])
+					{
+						MemGroup &group = mem_group[g];
+						auto diff = dyn_cast<SCEVConstant>(SE.getMinusSCEV(ptr, group.anchor));
+						if (!diff || diff->getAPInt().getMinSignedBits() > 64)
+						{
+							continue;
+						}
+						int64_t offset = diff->getAPInt().getSExtValue();
+						int64_t begin = std::min(group.begin, offset);
+						int64_t end = std::max(group.end, offset + (int64_t)width);
+						if (end - begin > (int64_t)GroupWindow)
+						{
+							continue;
+						}
+
+						// one check at cdom has to run less often than the
+						// group's check and this access's check apart
+						Instruction *cdom = findNearestCommonDominator(DT, group.dom, &I);
+						uint64_t separate = SaturatingAdd(getFrequency(group.dom->getParent()), getFrequency(BB));
+						if (getFrequency(cdom->getParent()) > separate)
+						{
+							tooCostly = {getFrequency(cdom->getParent()), separate};
+							continue;
+						}
+						const SCEV *start = SE.getAddExpr(group.anchor, SE.getConstant(DL.getIndexType(addr->getType()), begin));
+						bool ok = isSafeToExpandAt(start, cdom, SE) && isAnticipated(PDT, cdom, &I) && !mayFreeBetween(cdom, &I, addr);
+						for (unsigned i = 0; ok && i < group.insts.size(); ++i)
+						{
+							ok = isAnticipated(PDT, cdom, group.insts[i]) &&
+								 !mayFreeBetween(cdom, group.insts[i], getLoadStorePointerOperand(group.insts[i]));
+						}
+						if (ok)
+						{
+							group.insts.push_back(&I);
+							group.dom = cdom;
+							group.begin = begin;
+							group.end = end;
+							grouped = true;
+							break;
+						}
+					}
+					if (!grouped)
+					{
+						if (tooCostly)
+						{
+							rejectPlacement(&I, tooCostly->first, tooCostly->second);
+						}
+						ptr_group[base].push_back(mem_group.size());
+						mem_group.push_back({{&I}, &I, ptr, 0, width});
+					}
+				}
+			}
+			LLVM_DEBUG({
+				dbgs() << "OptimizeASan: " << mem_group.size() << " groups\n";
+				for (MemGroup &group : mem_group)
+				{
+					dbgs() << "  [" << group.begin << ", " << group.end << "):\n";
+					for (Instruction *inst : group.insts)
+					{
+						dbgs() << "   " << *inst << "\n";
+					}
+				}
+			});
+
+			for (MemGroup &group : mem_group)
+			{
+				if (group.insts.size() == 1)
+				{
+					continue;
+				}
+
+				for (auto &inst : group.insts)
+				{
+					inst->setMetadata(LLVMContext::MD_nosanitize, nosanitize);
+				}
+				NumGrouped += group.insts.size();
+				++NumGroupChecks;
+				ORE.emit([&]()
+						 { return OptimizationRemark(DEBUG_TYPE, "Grouped", group.insts.front())
+								  << "checks of " << ore::NV("NumAccesses", (unsigned)group.insts.size())
+								  << " accesses merged into one check of " << ore::NV("Bytes", group.end - group.begin) << " bytes"; });
+
+				// use the first access's own address if it covers the group,
+				// otherwise rebuild the start address from SCEV
+				Value *ptr = getLoadStorePointerOperand(group.insts.front());
+				if (group.begin != 0 || !DT.dominates(ptr, group.dom))
+				{
+					Type *intPtrTy = DL.getIndexType(group.anchor->getType());
+					const SCEV *start = SE.getAddExpr(group.anchor, SE.getConstant(intPtrTy, group.begin));
+					SCEVExpander expander(SE, DL, "asan.group");
+					ptr = expander.expandCodeFor(start, group.anchor->getType(), group.dom);
+				}
+				unsigned size = group.end - group.begin;
+
+				// Small groups of loads keep an inline ASan check, via a load
+				// as wide as the group. That would report a store as a read,
+				// so other groups check the region out of line. If the
+				// accesses are all as wide and line up from the start of the
+				// group, the report names the one the poison falls in.
+				if (size <= 16 && !allStores(group.insts))
+				{
+					Type *ty = Type::getIntNTy(context, size * 8);
+					IRBuilder<> builder(group.dom);
+					builder.SetCurrentDebugLocation(group.insts.front()->getDebugLoc());
+					builder.CreateAlignedLoad(ty, builder.CreatePointerCast(ptr, ty->getPointerTo()), MaybeAlign(1));
+				}
+				else
+				{
+					unsigned width = DL.getTypeStoreSize(getLoadStoreType(group.insts.front()));
+					bool lined = true;
+					for (Instruction *inst : group.insts)
+					{
+						auto diff = dyn_cast<SCEVConstant>(SE.getMinusSCEV(SE.getSCEV(getLoadStorePointerOperand(inst)), group.anchor));
+						lined = lined && diff && DL.getTypeStoreSize(getLoadStoreType(inst)) == width &&
+								(diff->getAPInt().getSExtValue() - group.begin) % width == 0;
+					}
+					insertRegionCheck(group.dom, ptr, ConstantInt::get(Type::getInt64Ty(context), size), lined ? width : 1, lined ? width : 0, group.insts);
+				}
+			}
+		}
+
+		void vectorizeCheckFreeLoops(Function &F)
+		{
+			/**
+			 * Vectorization of check-free loops: once every access in an
+			 * innermost loop has had its check hoisted or removed, nothing
+			 * ASan adds to the loop stands in the vectorizer's way. With
+			 * -optimize-asan-vectorize such loops get
+			 * llvm.loop.vectorize.enable and the loop vectorizer runs
+			 * again on just the loops so marked, since in clang's pipeline
+			 * it has already run by the time this pass does. The vector
+			 * code it adds between a loop's preheader and exit only touches
+			 * the range the hoisted check covers, so its accesses are
+			 * nosanitize too.
+			 */
+
+			if (!Vectorize)
+			{
+				return;
+			}
+
+			LLVMContext &context = F.getContext();
+			MDNode *nosanitize = MDNode::get(context, MDString::get(context, "nosanitize"));
+
+			struct Candidate
+			{
+				WeakVH header;
+				WeakVH preheader;
+				WeakVH exit;
+			};
+			std::vector<Candidate> candidates;
+			LoopInfo &LI = getAnalysis<LoopAnalysis>();
+			for (Loop *L : LI.getLoopsInPreorder())
+			{
+				if (!L->isInnermost() || !L->getLoopPreheader() || !L->getExitBlock())
+				{
+					continue;
+				}
+				bool hoisted = false;
+				bool checked = false;
+				for (BasicBlock *BB : L->blocks())
+				{
+					for (Instruction &I : *BB)
+					{
+						if (isa<LoadInst>(I) || isa<StoreInst>(I))
+						{
+							(getCheckedAccess(&I).first ? checked : hoisted) = true;
+						}
+					}
+				}
+				if (checked || !hoisted)
+				{
+					continue;
+				}
+				// leave an explicit vectorize(disable) alone
+				if (!findStringMetadataForLoop(L, "llvm.loop.vectorize.enable"))
+				{
+					addStringMetadataToLoop(L, "llvm.loop.vectorize.enable", 1);
+				}
+				else if (!getBooleanLoopAttribute(L, "llvm.loop.vectorize.enable"))
+				{
+					continue;
+				}
+				candidates.push_back({L->getHeader(), L->getLoopPreheader(), L->getExitBlock()});
+			}
+			if (candidates.empty())
+			{
+				return;
+			}
+
+			// A block the vectorizer deletes nulls its handle, so a new block
+			// at the same address isn't mistaken for an old one.
+			std::vector<WeakVH> blocksBefore;
+			for (BasicBlock &BB : F)
+			{
+				blocksBefore.emplace_back(&BB);
+			}
+
+			// The earlier optimizations changed the CFG behind FAM's back.
+			// Only loops with llvm.loop.vectorize.enable are vectorized or
+			// interleaved, so the rest of the function is left alone.
+			FAM->invalidate(F, PreservedAnalyses::none());
+			FAM->invalidate(F, LoopVectorizePass(LoopVectorizeOptions(true, true)).run(F, *FAM));
+
+			std::unordered_set<Value *> oldBlocks;
+			for (WeakVH &BB : blocksBefore)
+			{
+				if (BB)
+				{
+					oldBlocks.insert(BB);
+				}
+			}
+
+			// The vectorizer keeps the original loop as the scalar remainder
+			// and marks it llvm.loop.isvectorized.
+			DominatorTree &DT = getAnalysis<DominatorTreeAnalysis>();
+			LoopInfo &newLI = getAnalysis<LoopAnalysis>();
+			OptimizationRemarkEmitter &ORE = getAnalysis<OptimizationRemarkEmitterAnalysis>();
+			for (Candidate &candidate : candidates)
+			{
+				if (!candidate.header || !candidate.preheader || !candidate.exit)
+				{
+					continue;
+				}
+				auto header = cast<BasicBlock>(candidate.header);
+				Loop *L = newLI.getLoopFor(header);
+				if (!L || !getBooleanLoopAttribute(L, "llvm.loop.isvectorized"))
+				{
+					ORE.emit([&]()
+							 { return OptimizationRemarkMissed(DEBUG_TYPE, "NotVectorized", header->getTerminator())
+									  << "loop has no checks left but was not vectorized"; });
+					continue;
+				}
+
+				auto preheader = cast<BasicBlock>(candidate.preheader);
+				auto exit = cast<BasicBlock>(candidate.exit);
+				for (BasicBlock &BB : F)
+				{
+					if (oldBlocks.count(&BB) || !DT.dominates(preheader, &BB) || DT.dominates(exit, &BB))
+					{
+						continue;
+					}
+					for (Instruction &I : BB)
+					{
+						if (I.mayReadOrWriteMemory())
+						{
+							I.setMetadata(LLVMContext::MD_nosanitize, nosanitize);
+						}
+					}
+				}
+				++NumVectorized;
+				ORE.emit([&]()
+						 { return OptimizationRemark(DEBUG_TYPE, "Vectorized", L->getStartLoc(), header)
+								  << "loop vectorized after all its checks were hoisted"; });
+			}
+		}
+
+		PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM)
+		{
+			if (F.isDeclaration() || (onlySanitized && !F.hasFnAttribute(Attribute::SanitizeAddress)))
+			{
+				return PreservedAnalyses::all();
+			}
+			curF = &F;
+			FAM = &AM;
+
+			LLVM_DEBUG(dbgs() << "OptimizeASan: running on " << F.getName() << "\n");
+
+			BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyAnalysis>();
+			blockFreq.clear();
+			for (BasicBlock &BB : F)
+			{
+				blockFreq[&BB] = BFI.getBlockFreq(&BB).getFrequency();
+			}
+
+			inBoundsCheckElimination(F);
+			rangeCheckOptimization(F);
+			batchedCheckOptimization(F);
+			boundedIndexOptimization(F);
+
+			availableCheckElimination(F);
+			groupCheckOptimization(F);
+
 			invariantAddressOptimization(F);
 
-			return true;
+			// last, since it rebuilds LoopInfo and leaves ScalarEvolution
+			// stale
+			frequentPathOptimization(F);
+
+			vectorizeCheckFreeLoops(F);
+
+			return PreservedAnalyses::none();
+		}
+	};
+
+	struct OptimizeASanSummaries : public PassInfoMixin<OptimizeASanSummaries>
+	{
+		/**
+		 * Interprocedural entry check elimination: a function's summary
+		 * lists the accesses it makes to its pointer parameters (at
+		 * constant offsets) before anything can free memory or leave the
+		 * function. At a call site where the caller has already accessed
+		 * the same bytes of the argument, with nothing in between that may
+		 * free them, those accesses don't need their checks. If every
+		 * caller of a local function covers an access, its check is
+		 * dropped in place. Otherwise the calls that cover all of them go
+		 * to a clone without the checks, for functions of at most
+		 * -optimize-asan-clone-limit instructions.
+		 */
+
+		bool onlySanitized;
+		OptimizeASanSummaries(bool onlySanitized = false) : onlySanitized(onlySanitized) {}
+
+		static bool isRequired() { return true; }
+
+		// An access to pointer parameter `arg` plus `offset` bytes.
+		struct EntryAccess
+		{
+			Instruction *inst;
+			unsigned arg;
+			int64_t offset;
+			unsigned width;
+		};
+
+		// Runs the function pass's helpers (getCheckedAccess,
+		// mayFreeMemory, ...) on another function.
+		OptimizeASan helper;
+		OptimizeASan &on(Function &F)
+		{
+			helper.curF = &F;
+			return helper;
+		}
+
+		bool isCandidate(Function &F)
+		{
+			return !F.isDeclaration() && (!onlySanitized || F.hasFnAttribute(Attribute::SanitizeAddress));
+		}
+
+		std::vector<EntryAccess> getSummary(Function &F)
+		{
+			const DataLayout &DL = F.getParent()->getDataLayout();
+			std::vector<EntryAccess> summary;
+			for (Instruction &I : F.getEntryBlock())
+			{
+				auto [ptr, width] = on(F).getCheckedAccess(&I);
+				if (ptr)
+				{
+					int64_t offset = 0;
+					auto arg = dyn_cast<Argument>(GetPointerBaseWithConstantOffset(ptr, offset, DL));
+					// a byval argument points to the callee's own copy
+					if (arg && !arg->hasPassPointeeByValueCopyAttr())
+					{
+						summary.push_back({&I, arg->getArgNo(), offset, width});
+					}
+				}
+				if (on(F).mayFreeMemory(&I) || !isGuaranteedToTransferExecutionToSuccessor(&I))
+				{
+					break;
+				}
+			}
+			return summary;
+		}
+
+		// Returns true if, by the time call runs, its caller has accessed
+		// every byte of the argument that access touches, and nothing
+		// since may have freed them.
+		bool isCovered(CallBase *call, const EntryAccess &access)
+		{
+			Function &caller = *call->getFunction();
+			if (!isCandidate(caller))
+			{
+				return false;
+			}
+			const DataLayout &DL = caller.getParent()->getDataLayout();
+			DominatorTree &DT = helper.FAM->getResult<DominatorTreeAnalysis>(caller);
+
+			int64_t argOffset = 0;
+			Value *base = GetPointerBaseWithConstantOffset(call->getArgOperand(access.arg), argOffset, DL);
+			int64_t begin = argOffset + access.offset;
+			int64_t end = begin + access.width;
+			for (Instruction &I : instructions(caller))
+			{
+				auto [ptr, width] = on(caller).getCheckedAccess(&I);
+				if (!ptr || !DT.dominates(&I, call))
+				{
+					continue;
+				}
+				int64_t offset = 0;
+				if (GetPointerBaseWithConstantOffset(ptr, offset, DL) != base || offset > begin || offset + (int64_t)width < end)
+				{
+					continue;
+				}
+				if (!on(caller).mayFreeBetween(&I, call, ptr))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM)
+		{
+			helper.FAM = &MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+			LLVMContext &context = M.getContext();
+			MDNode *nosanitize = MDNode::get(context, MDString::get(context, "nosanitize"));
+
+			// Decide everything before changing anything: once a callee's
+			// access is marked nosanitize it no longer counts as a check
+			// for the calls it makes.
+			struct Plan
+			{
+				Function *F;
+				std::vector<EntryAccess> summary;
+				std::vector<Instruction *> inPlace;
+				std::vector<CallBase *> redirect;
+			};
+			std::vector<Plan> plans;
+			for (Function &F : M)
+			{
+				// an interposable body may not be the one that runs
+				if (!isCandidate(F) || F.isInterposable())
+				{
+					continue;
+				}
+				Plan plan{&F, getSummary(F), {}, {}};
+				if (plan.summary.empty())
+				{
+					continue;
+				}
+
+				bool allCallsKnown = F.hasLocalLinkage();
+				std::vector<CallBase *> calls;
+				for (Use &U : F.uses())
+				{
+					auto call = dyn_cast<CallBase>(U.getUser());
+					if (call && call->isCallee(&U) && call->getFunctionType() == F.getFunctionType())
+					{
+						calls.push_back(call);
+					}
+					else
+					{
+						allCallsKnown = false;
+					}
+				}
+
+				std::vector<bool> coveredEverywhere(plan.summary.size(), allCallsKnown && !calls.empty());
+				for (CallBase *call : calls)
+				{
+					bool coversAll = true;
+					for (unsigned i = 0; i < plan.summary.size(); ++i)
+					{
+						bool covered = isCovered(call, plan.summary[i]);
+						coveredEverywhere[i] = coveredEverywhere[i] && covered;
+						coversAll = coversAll && covered;
+					}
+					if (coversAll)
+					{
+						plan.redirect.push_back(call);
+					}
+				}
+				for (unsigned i = 0; i < plan.summary.size(); ++i)
+				{
+					if (coveredEverywhere[i])
+					{
+						plan.inPlace.push_back(plan.summary[i].inst);
+					}
+				}
+				if (plan.inPlace.size() == plan.summary.size() || F.getInstructionCount() > CloneLimit)
+				{
+					plan.redirect.clear();
+				}
+				if (!plan.inPlace.empty() || !plan.redirect.empty())
+				{
+					plans.push_back(plan);
+				}
+			}
+
+			for (Plan &plan : plans)
+			{
+				OptimizationRemarkEmitter &ORE = helper.FAM->getResult<OptimizationRemarkEmitterAnalysis>(*plan.F);
+				for (Instruction *inst : plan.inPlace)
+				{
+					inst->setMetadata(LLVMContext::MD_nosanitize, nosanitize);
+					++NumEntryChecks;
+					ORE.emit([&]()
+							 { return OptimizationRemark(DEBUG_TYPE, "EntryCheckRemoved", inst)
+									  << "check removed: every caller already checked the argument"; });
+				}
+				if (plan.redirect.empty())
+				{
+					continue;
+				}
+
+				ValueToValueMapTy VMap;
+				Function *clone = CloneFunction(plan.F, VMap);
+				clone->setName(plan.F->getName() + ".asan.unchecked");
+				clone->setLinkage(GlobalValue::InternalLinkage);
+				clone->setComdat(nullptr);
+				for (EntryAccess &access : plan.summary)
+				{
+					cast<Instruction>(VMap[access.inst])->setMetadata(LLVMContext::MD_nosanitize, nosanitize);
+				}
+				++NumUncheckedClones;
+				for (CallBase *call : plan.redirect)
+				{
+					call->setCalledFunction(clone);
+					++NumRedirectedCalls;
+					OptimizationRemarkEmitter &callerORE = helper.FAM->getResult<OptimizationRemarkEmitterAnalysis>(*call->getFunction());
+					callerORE.emit([&]()
+								   { return OptimizationRemark(DEBUG_TYPE, "UncheckedClone", call)
+											<< "call redirected to " << ore::NV("Callee", clone)
+											<< ": the caller already checked the arguments"; });
+				}
+			}
+
+			return plans.empty() ? PreservedAnalyses::all() : PreservedAnalyses::none();
 		}
 	};
 }
 
-char OptimizeASan::ID = 0;
-static RegisterPass<OptimizeASan> X("optimize_asan", "Optimize ASan", false, false);
+// Registers "optimize-asan" and the module pass "optimize-asan-ipo" for
+// -passes pipelines, and puts both at the end of the optimization
+// pipeline so that clang -fsanitize=address -fpass-plugin=... runs them
+// just before ModuleAddressSanitizerPass (clang registers its sanitizer
+// callbacks after plugin callbacks).
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo()
+{
+	return {LLVM_PLUGIN_API_VERSION, "OptimizeASan", LLVM_VERSION_STRING,
+			[](PassBuilder &PB)
+			{
+				PB.registerPipelineParsingCallback(
+					[](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>)
+					{
+						if (Name == "optimize-asan")
+						{
+							FPM.addPass(OptimizeASan());
+							return true;
+						}
+						return false;
+					});
+				PB.registerPipelineParsingCallback(
+					[](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>)
+					{
+						if (Name == "optimize-asan-ipo")
+						{
+							MPM.addPass(OptimizeASanSummaries());
+							return true;
+						}
+						return false;
+					});
+				PB.registerOptimizerLastEPCallback(
+					[](ModulePassManager &MPM, OptimizationLevel)
+					{
+						MPM.addPass(OptimizeASanSummaries(true));
+						MPM.addPass(createModuleToFunctionPassAdaptor(OptimizeASan(true)));
+					});
+			}};
+}
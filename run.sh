@@ -6,10 +6,16 @@ set -Eeuo pipefail
 
 # b = view LLVM bytecode
 # o = run OptimizeASan pass
+# v = with -o, vectorize the loops OptimizeASan leaves free of checks and
+#     print which ones were vectorized
+# j = with -o, run OptimizeASan over this many parts of the module in
+#     parallel (see split_opt.sh)
 VIEW_BYTECODE=0
 RUN_ASAN=0
 RUN_OPT_ASAN=0
-while getopts "bao" opt; do
+VECTORIZE=0
+JOBS=0
+while getopts "baovj:" opt; do
     case $opt in
         b)
             VIEW_BYTECODE=1
@@ -20,6 +26,12 @@ while getopts "bao" opt; do
         o)
             RUN_OPT_ASAN=1
             ;;
+        v)
+            VECTORIZE=1
+            ;;
+        j)
+            JOBS=$OPTARG
+            ;;
     esac
 done
 
@@ -53,26 +65,41 @@ opt -passes="pgo-instr-use" -o $TESTCASE.bc -pgo-test-profile-file=$TESTCASE.pro
 # Now, our .bc file is augmented with the profile data.
 # Below, we run our own passes.
 
-# Run mem2reg.
-opt -mem2reg $TESTCASE.bc -o $TESTCASE.out.bc
-mv $TESTCASE.out.bc $TESTCASE.bc
-
-# Run loop-rotate.
-opt -loop-rotate $TESTCASE.bc -o $TESTCASE.out.bc
-mv $TESTCASE.out.bc $TESTCASE.bc
-
+# Run mem2reg, loop-rotate and the selected ASan passes in a single opt
+# invocation, so analyses are shared and the bitcode is only written once.
+# With clang, the equivalent is:
+#   clang -fsanitize=address -fpass-plugin=build/optimize_asan/LLVMPJT_OPTIMIZE_ASAN.so ...
+PASSES="function(mem2reg,loop-rotate)"
 if [ "$RUN_OPT_ASAN" -eq 1 ]; then
-    # Run OptimizeASan.
-    opt -enable-new-pm=0 -load build/optimize_asan/LLVMPJT_OPTIMIZE_ASAN.so -optimize_asan < $TESTCASE.bc > $TESTCASE.out.bc
-    mv $TESTCASE.out.bc $TESTCASE.bc
+    PASSES="$PASSES,optimize-asan-ipo,function(optimize-asan)"
 fi
-
 if [ "$RUN_ASAN" -eq 1 ]; then
-    # Run ASan instrumentation.
-    opt -enable-new-pm=0 -load build/asan/LLVMPJT_ASAN.so -asan < $TESTCASE.bc > $TESTCASE.out.bc
-    mv $TESTCASE.out.bc $TESTCASE.bc
+    PASSES="$PASSES,asan"
 fi
 
+# The pass's options are only known to opt once the plugin is loaded with
+# -load.
+OPT_FLAGS=""
+if [ "$VECTORIZE" -eq 1 ]; then
+    OPT_FLAGS="-load build/optimize_asan/LLVMPJT_OPTIMIZE_ASAN.so -optimize-asan-vectorize -pass-remarks=optimize-asan -pass-remarks-missed=optimize-asan"
+fi
+
+# Run OptimizeASan on its own, split across processes, and leave the rest
+# of the pipeline to the opt run below.
+if [ "$RUN_OPT_ASAN" -eq 1 ] && [ "$JOBS" -gt 0 ]; then
+    opt -passes='function(mem2reg,loop-rotate)' $TESTCASE.bc -o $TESTCASE.out.bc
+    ./split_opt.sh -j $JOBS $TESTCASE.out.bc $TESTCASE.bc $OPT_FLAGS
+    PASSES="verify"
+    if [ "$RUN_ASAN" -eq 1 ]; then
+        PASSES="asan"
+    fi
+fi
+
+opt $OPT_FLAGS -load-pass-plugin build/optimize_asan/LLVMPJT_OPTIMIZE_ASAN.so \
+    -load-pass-plugin build/asan/LLVMPJT_ASAN.so \
+    -passes="$PASSES" $TESTCASE.bc -o $TESTCASE.out.bc
+mv $TESTCASE.out.bc $TESTCASE.bc
+
 if [ "$VIEW_BYTECODE" -eq 1 ]; then
     # Show bytecode.
     llvm-dis $TESTCASE.bc -o -
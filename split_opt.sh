@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Runs OptimizeASan on a bitcode file with the per-function work spread over
+# several opt processes. The interprocedural pass (optimize-asan-ipo) runs on
+# the whole module first. The module is then split into parts, keeping local
+# symbols with their users, each part goes through optimize-asan in parallel,
+# and the parts are linked back together. Any arguments after the output file
+# are passed to every opt run.
+#
+# Example usage: ./split_opt.sh -j 8 hw2perf1.bc hw2perf1.opt.bc
+#                ./split_opt.sh in.bc out.bc -load build/optimize_asan/LLVMPJT_OPTIMIZE_ASAN.so -optimize-asan-vectorize
+
+set -Eeuo pipefail
+
+# j = number of parts, and of opt processes running at once
+JOBS=$(nproc)
+while getopts "j:" opt; do
+    case $opt in
+        j)
+            JOBS=$OPTARG
+            ;;
+    esac
+done
+
+shift $((OPTIND - 1))
+
+IN=$1
+OUT=$2
+shift 2
+
+PLUGIN=$(dirname $(realpath $0))/build/optimize_asan/LLVMPJT_OPTIMIZE_ASAN.so
+TMP_DIR=$(mktemp -d)
+trap "rm -rf $TMP_DIR" EXIT
+
+opt "$@" -load-pass-plugin $PLUGIN -passes='optimize-asan-ipo' $IN -o $TMP_DIR/module.bc
+
+# Parts are written as part0, part1, ...
+llvm-split -j $JOBS --preserve-locals $TMP_DIR/module.bc -o $TMP_DIR/part
+
+ls $TMP_DIR/part* | xargs -P $JOBS -I{} opt "$@" -load-pass-plugin $PLUGIN -passes='function(optimize-asan)' {} -o {}.opt.bc
+
+llvm-link $TMP_DIR/part*.opt.bc -o $OUT